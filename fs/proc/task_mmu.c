@@ -1056,6 +1056,37 @@ const struct file_operations proc_pid_smaps_rollup_operations = {
 	.release	= smaps_rollup_release,
 };
 
+/*
+ * The checkpoint counters of the mm. They live in the mm_struct, which the
+ * mm reference keeps around, rather than in the checkpoint's stage, which
+ * can be freed at any time. They are updated with WRITE_ONCE() under
+ * whichever lock the checkpoint code holds, and read here without any.
+ */
+int proc_pid_checkpoint(struct seq_file *m, struct pid_namespace *ns,
+			struct pid *pid, struct task_struct *task)
+{
+	struct mm_struct *mm = mm_access(task, PTRACE_MODE_READ_FSCREDS);
+	struct mmcontext_stats *st;
+
+	if (IS_ERR_OR_NULL(mm))
+		return PTR_ERR_OR_ZERO(mm);
+
+	st = &mm->ckpt_stats;
+	seq_printf(m, "Active:\t%d\n", READ_ONCE(mm->saved_context));
+	seq_printf(m, "Checkpoints:\t%llu\n", READ_ONCE(st->checkpoints));
+	seq_printf(m, "Protected:\t%llu\n", READ_ONCE(st->protected));
+	seq_printf(m, "CowSaves:\t%llu\n", READ_ONCE(st->cow_saves));
+	seq_printf(m, "Pinned:\t%llu\n", READ_ONCE(st->pinned));
+	seq_printf(m, "BytesWritten:\t%llu\n", READ_ONCE(st->bytes_written));
+	seq_printf(m, "Reserved:\t%llu\n", READ_ONCE(st->reserved));
+	seq_printf(m, "FaultTimeNs:\t%llu\n", READ_ONCE(st->fault_ns));
+	seq_printf(m, "Restores:\t%llu\n", READ_ONCE(st->restores));
+	seq_printf(m, "RestorePages:\t%llu\n", READ_ONCE(st->restore_pages));
+	seq_printf(m, "RestoreTimeNs:\t%llu\n", READ_ONCE(st->restore_ns));
+	mmput(mm);
+	return 0;
+}
+
 enum clear_refs_types {
 	CLEAR_REFS_ALL = 1,
 	CLEAR_REFS_ANON,
@@ -251,6 +251,9 @@ struct mem_cgroup {
 	struct page_counter kmem;		/* v1 only */
 	struct page_counter tcpmem;		/* v1 only */
 
+	/* Checkpoint budget, memory.checkpoint.max */
+	struct page_counter checkpoint;
+
 	/* Range enforcement for interrupt charges */
 	struct work_struct high_work;
 
@@ -772,6 +775,11 @@ struct mem_cgroup *mem_cgroup_from_task(struct task_struct *p);
 
 struct mem_cgroup *get_mem_cgroup_from_mm(struct mm_struct *mm);
 
+bool mem_cgroup_charge_checkpoint(struct mem_cgroup *memcg,
+				  unsigned long nr_pages);
+void mem_cgroup_uncharge_checkpoint(struct mem_cgroup *memcg,
+				    unsigned long nr_pages);
+
 struct lruvec *folio_lruvec_lock(struct folio *folio);
 struct lruvec *folio_lruvec_lock_irq(struct folio *folio);
 struct lruvec *folio_lruvec_lock_irqsave(struct folio *folio,
@@ -1293,6 +1301,17 @@ static inline struct mem_cgroup *get_mem_cgroup_from_mm(struct mm_struct *mm)
 	return NULL;
 }
 
+static inline bool mem_cgroup_charge_checkpoint(struct mem_cgroup *memcg,
+						unsigned long nr_pages)
+{
+	return true;
+}
+
+static inline void mem_cgroup_uncharge_checkpoint(struct mem_cgroup *memcg,
+						  unsigned long nr_pages)
+{
+}
+
 static inline
 struct mem_cgroup *mem_cgroup_from_css(struct cgroup_subsys_state *css)
 {
@@ -483,20 +483,35 @@ struct vm_area_struct {
 } __randomize_layout;
 
 struct kioctx_table;
-
-struct saved_page
-{
-	unsigned long int vpage;
-	struct saved_page * next;
+struct mmcontext_stage;
+struct mmcontext_layout;
+struct mmcontext_golden;
+
+/* Checkpoint counters, shown in /proc/<pid>/checkpoint. */
+struct mmcontext_stats {
+	u64 checkpoints;
+	u64 protected;		/* pages write-protected by the last checkpoint */
+	u64 cow_saves;		/* pages saved on a write fault */
+	u64 pinned;		/* pinned pages saved by the last checkpoint */
+	u64 bytes_written;	/* to the checkpoint file */
+	u64 reserved;		/* bytes preallocated by the last checkpoint */
+	u64 fault_ns;		/* time spent saving pages in the fault path */
+	u64 restores;
+	u64 restore_pages;
+	u64 restore_ns;
 };
 
 struct mm_struct {
 	struct {
-		bool saved_context;
+		u8 saved_context;		/* MMCONTEXT_TRACK_*, or 0 */
 		struct file *fp;
-		struct saved_page *save_curr;
-		struct saved_page *save;
+		struct list_head saved_pages;	/* struct saved_page, see mmcontext.h */
 		loff_t offset;
+		struct mmcontext_stage *stage;
+		struct mmcontext_layout *layout;	/* NULL when appending */
+		struct mmcontext_stats ckpt_stats;
+		struct mmcontext_golden *golden;
+		struct mutex mmcontext_lock;	/* serialises sys_mmcontext() */
 		struct vm_area_struct *mmap;		/* list of VMAs */
 		struct rb_root mm_rb;
 		u64 vmacache_seqnum;                   /* per-thread vmacache */
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _LINUX_MMCONTEXT_H
+#define _LINUX_MMCONTEXT_H
+
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/userfaultfd_k.h>
+
+/*
+ * Anonymous memory checkpoint/restore.
+ *
+ * sys_mmcontext(0) write-protects the anonymous memory of the calling
+ * process; the first write to each page afterwards copies the old
+ * contents out to the checkpoint file. Pages are tracked with the
+ * userfaultfd write-protect pte bit, which follows them through swap,
+ * migration, THP splits and mprotect(); vmas registered for
+ * userfaultfd-wp by userspace are left out. Pages pinned for DMA, which a
+ * device can write without a fault, are copied out at checkpoint time
+ * instead. Pages dropped with MADV_DONTNEED or MADV_FREE before they were
+ * saved are handed over to the checkpoint as they are. sys_mmcontext(1)
+ * copies all the saved pages back, to wherever mremap() has moved them
+ * since, and drops the checkpoint.
+ *
+ * sys_mmcontext(4) checkpoints with soft-dirty tracking instead: every
+ * resident page is copied to the checkpoint file up front and its
+ * soft-dirty bit cleared, so later writes save nothing. sys_mmcontext(1)
+ * copies back only the pages that are soft-dirty. Calling sys_mmcontext(4)
+ * again while such a checkpoint is active is a save point: the pages
+ * dirtied since are saved again and the checkpoint moves forward to it.
+ * A save point that fails while saving pages drops the checkpoint.
+ *
+ * With MMCONTEXT_FIXED_LAYOUT, sys_mmcontext(0) lays the checkpoint file
+ * out sparsely by virtual address instead of appending to it, so that
+ * a page can be found in it without an index.
+ *
+ * Checkpoint files live in mmcontext.dir=. On a DAX filesystem, pages
+ * are copied straight between user memory and persistent memory.
+ *
+ * Checkpoint memory is charged to the memcg of the process. A checkpoint
+ * or save point that could take its cgroup over memory.checkpoint.max
+ * fails with -ENOMEM.
+ *
+ * sys_mmcontext(2) instead takes a golden image: a read-only snapshot of
+ * the anonymous memory that is shared with every child forked afterwards.
+ * sys_mmcontext(1) in any of them, when no checkpoint is active, puts
+ * back the pages that changed since, THPs included, and zaps memory that
+ * was unpopulated or mapped the zero page at the time. sys_mmcontext(3)
+ * drops the caller's reference to the golden image.
+ */
+
+#define MMCONTEXT_CHECKPOINT	0
+#define MMCONTEXT_RESTORE	1
+#define MMCONTEXT_GOLDEN	2
+#define MMCONTEXT_GOLDEN_DROP	3
+#define MMCONTEXT_CHECKPOINT_SOFT_DIRTY	4
+#define MMCONTEXT_OP_MASK	0xff
+
+/* Flags for MMCONTEXT_CHECKPOINT, or'ed into the op. */
+#define MMCONTEXT_FIXED_LAYOUT	0x100	/* save at offsets fixed by address */
+
+/* mm->saved_context: how the active checkpoint finds written pages. */
+#define MMCONTEXT_TRACK_WP		1
+#define MMCONTEXT_TRACK_SOFT_DIRTY	2
+
+/*
+ * One saved page: where it was saved from, as the anon_vma of its vma and
+ * its linear page index in it, and where its old contents live in mm->fp,
+ * or, for a page the checkpoint took over when it was zapped, the page
+ * itself, NULL for the zero page. mremap() keeps both the anon_vma and the
+ * page index of the memory it moves, so the entry follows the page to its
+ * new address. It holds a reference to @anon_vma.
+ */
+struct saved_page {
+	struct list_head list;
+	struct anon_vma *anon_vma;
+	pgoff_t pgoff;
+	union {
+		loff_t offset;
+		struct page *page;
+	};
+};
+
+#ifdef CONFIG_MMU
+extern vm_fault_t mmcontext_save_page(struct vm_fault *vmf);
+extern void mmcontext_dup_mmap(struct mm_struct *oldmm, struct mm_struct *mm);
+extern void mmcontext_exit_mm(struct mm_struct *mm);
+extern int __mmcontext_zap(struct vm_area_struct *vma, unsigned long start,
+			   unsigned long end);
+
+/*
+ * The uffd-wp bits of a vma belong to the checkpoint, rather than to
+ * userfaultfd, while a write-protect checkpoint is active and the vma is
+ * not registered for userfaultfd-wp.
+ */
+static inline bool mmcontext_vma_wp(struct vm_area_struct *vma)
+{
+	return vma->vm_mm->saved_context == MMCONTEXT_TRACK_WP &&
+	       !userfaultfd_wp(vma);
+}
+
+/*
+ * The page indexes of an anonymous vma key its saved pages while a
+ * checkpoint of either kind is active, so nothing may duplicate them.
+ */
+static inline bool mmcontext_vma_active(struct vm_area_struct *vma)
+{
+	return vma->vm_mm->saved_context && vma_is_anonymous(vma);
+}
+
+static inline bool mmcontext_pte_wp(struct vm_area_struct *vma, pte_t pte)
+{
+	return pte_uffd_wp(pte) && mmcontext_vma_wp(vma);
+}
+
+static inline bool mmcontext_huge_pmd_wp(struct vm_area_struct *vma,
+					 pmd_t pmd)
+{
+	return pmd_uffd_wp(pmd) && mmcontext_vma_wp(vma);
+}
+
+/*
+ * Called before MADV_DONTNEED or MADV_FREE drops the pages of @vma from
+ * @start to @end, for the checkpoint to take over those it has not saved.
+ */
+static inline int mmcontext_zap(struct vm_area_struct *vma,
+				unsigned long start, unsigned long end)
+{
+	if (!vma_is_anonymous(vma) || !mmcontext_vma_wp(vma))
+		return 0;
+	return __mmcontext_zap(vma, start, end);
+}
+#else
+static inline vm_fault_t mmcontext_save_page(struct vm_fault *vmf)
+{
+	return 0;
+}
+
+static inline void mmcontext_dup_mmap(struct mm_struct *oldmm,
+				      struct mm_struct *mm)
+{
+}
+
+static inline void mmcontext_exit_mm(struct mm_struct *mm)
+{
+}
+
+static inline bool mmcontext_vma_wp(struct vm_area_struct *vma)
+{
+	return false;
+}
+
+static inline bool mmcontext_vma_active(struct vm_area_struct *vma)
+{
+	return false;
+}
+
+static inline bool mmcontext_pte_wp(struct vm_area_struct *vma, pte_t pte)
+{
+	return false;
+}
+
+static inline bool mmcontext_huge_pmd_wp(struct vm_area_struct *vma,
+					 pmd_t pmd)
+{
+	return false;
+}
+
+static inline int mmcontext_zap(struct vm_area_struct *vma,
+				unsigned long start, unsigned long end)
+{
+	return 0;
+}
+#endif
+
+#endif /* _LINUX_MMCONTEXT_H */
@@ -147,6 +147,11 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		ZSWPIN,
 		ZSWPOUT,
 #endif
+#ifdef CONFIG_MMU
+		CKPT_PROTECT,
+		CKPT_COW_SAVE,
+		CKPT_RESTORE_PAGES,
+#endif
 #ifdef CONFIG_X86
 		DIRECT_MAP_LEVEL2_SPLIT,
 		DIRECT_MAP_LEVEL3_SPLIT,
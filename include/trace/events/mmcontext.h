@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mmcontext
+
+#if !defined(_TRACE_MMCONTEXT_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_MMCONTEXT_H
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+struct mm_struct;
+
+TRACE_EVENT(mmcontext_protect_vma,
+
+	TP_PROTO(struct mm_struct *mm, unsigned long start, unsigned long end,
+		 unsigned long nr_pages),
+
+	TP_ARGS(mm, start, end, nr_pages),
+
+	TP_STRUCT__entry(
+		__field(struct mm_struct *,	mm)
+		__field(unsigned long,		start)
+		__field(unsigned long,		end)
+		__field(unsigned long,		nr_pages)
+	),
+
+	TP_fast_assign(
+		__entry->mm = mm;
+		__entry->start = start;
+		__entry->end = end;
+		__entry->nr_pages = nr_pages;
+	),
+
+	TP_printk("mm=%p vma=0x%lx-0x%lx nr_pages=%lu",
+		__entry->mm, __entry->start, __entry->end, __entry->nr_pages)
+);
+
+TRACE_EVENT(mmcontext_checkpoint,
+
+	TP_PROTO(struct mm_struct *mm, unsigned long nr_pages, u64 latency_ns),
+
+	TP_ARGS(mm, nr_pages, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(struct mm_struct *,	mm)
+		__field(unsigned long,		nr_pages)
+		__field(u64,			latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->mm = mm;
+		__entry->nr_pages = nr_pages;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("mm=%p nr_pages=%lu latency_ns=%llu",
+		__entry->mm, __entry->nr_pages, __entry->latency_ns)
+);
+
+TRACE_EVENT(mmcontext_cow_save,
+
+	TP_PROTO(struct mm_struct *mm, unsigned long address, loff_t offset,
+		 u64 latency_ns),
+
+	TP_ARGS(mm, address, offset, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(struct mm_struct *,	mm)
+		__field(unsigned long,		address)
+		__field(loff_t,			offset)
+		__field(u64,			latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->mm = mm;
+		__entry->address = address;
+		__entry->offset = offset;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("mm=%p address=0x%lx offset=%lld latency_ns=%llu",
+		__entry->mm, __entry->address, __entry->offset,
+		__entry->latency_ns)
+);
+
+TRACE_EVENT(mmcontext_flush,
+
+	TP_PROTO(struct mm_struct *mm, loff_t offset, size_t bytes,
+		 u64 latency_ns, int ret),
+
+	TP_ARGS(mm, offset, bytes, latency_ns, ret),
+
+	TP_STRUCT__entry(
+		__field(struct mm_struct *,	mm)
+		__field(loff_t,			offset)
+		__field(size_t,			bytes)
+		__field(u64,			latency_ns)
+		__field(int,			ret)
+	),
+
+	TP_fast_assign(
+		__entry->mm = mm;
+		__entry->offset = offset;
+		__entry->bytes = bytes;
+		__entry->latency_ns = latency_ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("mm=%p offset=%lld bytes=%zu latency_ns=%llu ret=%d",
+		__entry->mm, __entry->offset, __entry->bytes,
+		__entry->latency_ns, __entry->ret)
+);
+
+TRACE_EVENT(mmcontext_restore,
+
+	TP_PROTO(struct mm_struct *mm, unsigned long nr_pages, u64 latency_ns,
+		 int ret),
+
+	TP_ARGS(mm, nr_pages, latency_ns, ret),
+
+	TP_STRUCT__entry(
+		__field(struct mm_struct *,	mm)
+		__field(unsigned long,		nr_pages)
+		__field(u64,			bytes)
+		__field(u64,			latency_ns)
+		__field(int,			ret)
+	),
+
+	TP_fast_assign(
+		__entry->mm = mm;
+		__entry->nr_pages = nr_pages;
+		__entry->bytes = (u64)nr_pages << PAGE_SHIFT;
+		__entry->latency_ns = latency_ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("mm=%p nr_pages=%lu bytes=%llu latency_ns=%llu ret=%d",
+		__entry->mm, __entry->nr_pages, __entry->bytes,
+		__entry->latency_ns, __entry->ret)
+);
+
+#endif /* _TRACE_MMCONTEXT_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
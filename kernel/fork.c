@@ -84,6 +84,7 @@
 #include <linux/user-return-notifier.h>
 #include <linux/oom.h>
 #include <linux/khugepaged.h>
+#include <linux/mmcontext.h>
 #include <linux/signalfd.h>
 #include <linux/uprobes.h>
 #include <linux/aio.h>
@@ -709,6 +710,8 @@ static __latent_entropy int dup_mmap(struct mm_struct *mm,
 	}
 	/* a new mm has just been created */
 	retval = arch_dup_mmap(oldmm, mm);
+	if (!retval)
+		mmcontext_dup_mmap(oldmm, mm);
 out:
 	mmap_write_unlock(mm);
 	flush_tlb_mm(oldmm);
@@ -1113,8 +1116,20 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p,
 	struct user_namespace *user_ns)
 {
 	mm->mmap = NULL;
+	/*
+	 * A child does not inherit the parent's checkpoint. dup_mmap() leaves
+	 * both sides' ptes read-only for COW anyway, so the child needs no
+	 * tracking state of its own, and the parent saves a page on its first
+	 * write before do_wp_page() breaks COW, see mmcontext_save_page().
+	 */
 	mm->saved_context = 0;
-	mm->fp =NULL;
+	mm->fp = NULL;
+	INIT_LIST_HEAD(&mm->saved_pages);
+	mm->stage = NULL;
+	mm->layout = NULL;
+	memset(&mm->ckpt_stats, 0, sizeof(mm->ckpt_stats));
+	mm->golden = NULL;
+	mutex_init(&mm->mmcontext_lock);
 	mm->mm_rb = RB_ROOT;
 	mm->vmacache_seqnum = 0;
 	atomic_set(&mm->mm_users, 1);
@@ -1190,6 +1205,7 @@ static inline void __mmput(struct mm_struct *mm)
 	ksm_exit(mm);
 	khugepaged_exit(mm); /* must run before exit_mmap */
 	exit_mmap(mm);
+	mmcontext_exit_mm(mm);
 	mm_put_huge_zero_page(mm);
 	set_mm_exe_file(mm, NULL);
 	if (!list_empty(&mm->mmlist)) {
@@ -2797,117 +2797,3 @@ COMPAT_SYSCALL_DEFINE1(sysinfo, struct compat_sysinfo __user *, info)
 	return 0;
 }
 #endif /* CONFIG_COMPAT */
-
-
-
-SYSCALL_DEFINE1(mmcontext, int, x)
-{
-	struct task_struct *p;
-	struct mm_struct *mm;
-	struct vm_area_struct *mmap, *itr;
-	char *f_name = "/save_file";
-	struct file *fp;
-	struct saved_page *head, *ptr; 
-	char *buf = kmalloc(PAGE_SIZE, GFP_KERNEL);  
-	unsigned long int vpage;
-	int X;
-	p = current;
-	mm = p->mm;
-	mmap = mm->mmap;
-	ptr = mm->save;
-	if(mm->fp)
-		fp=mm->fp;
-	else
-	{
-		fp = filp_open(f_name, O_RDWR | O_CREAT, 00700);
-		mm->fp =fp;
-	}
-	//printk("atomic context %d",in_atomic());
-	if(x == 0 && mm->saved_context == 0)
-	{
-		pgd_t *pgd;
-		p4d_t *p4d;
-		pud_t *pud;
-		pte_t *pte;
-		pmd_t *pmd;
-		//loff_t offset = 0;
-		itr = mmap;
-		mm->save_curr=NULL;
-		mm->offset = 0;
-		while (itr) {
-			if (vma_is_anonymous(itr)) {
-				if(!(mm->start_stack >= itr->vm_start && mm->start_stack <= itr->vm_end))
-				{
-					for (vpage = itr->vm_start; vpage < itr->vm_end;vpage += 4096) {
-						pgd = pgd_offset(mm, vpage);
-						if (pgd_none(*pgd) || pgd_bad(*pgd))
-							continue;
-						p4d = p4d_offset(pgd, vpage);
-						if (p4d_none(*p4d) || p4d_bad(*p4d))
-							continue;
-						pud = pud_offset(p4d, vpage);
-						if (pud_none(*pud) || pud_bad(*pud))
-							continue;
-						pmd = pmd_offset(pud, vpage);
-						if (pmd_none(*pmd) || pmd_bad(*pmd))
-							continue;
-						pte = pte_offset_map(pmd, vpage);
-						if (!pte_present(*pte)) continue;
-						{
-							
-							pte_t new_pte = pte_wrprotect(*pte);
-							flush_tlb_page(itr, vpage);
-							set_pte_at(mm,vpage,pte,new_pte);
-							pte = pte_offset_map(pmd, vpage);
-							
-							//update_mmu_tlb(itr,vpage,pte);//update tlb
-							/*struct saved_page *new = kmalloc(sizeof(struct saved_page),GFP_KERNEL);
-							new->next = NULL;
-							new->vpage = vpage;
-							if(ptr==NULL)
-							{
-								ptr= new;
-								mm->save=head=ptr;
-							}
-							else
-							{
-								ptr->next=new;
-								ptr=new;
-							}
-							X=copy_from_user(buf,(void *)vpage, PAGE_SIZE);
-							kernel_write(fp, buf,PAGE_SIZE,&offset);*/
-						}
-					}
-				}
-			}
-			itr = itr->vm_next;
-		}
-		//flush_tlb_mm(mm);
-		mm->saved_context = 1;
-	}
-    else if(x==1 && mm->saved_context)
-	{
-		
-		loff_t offset = 0;
-		unsigned long int address;
-		
-		ptr = mm->save;
-		while(ptr)
-		{
-			address = ptr->vpage;
-			kernel_read(fp,buf,PAGE_SIZE,&offset);
-			X=copy_to_user((void *)address,buf,PAGE_SIZE);
-			head=ptr;
-			ptr= ptr->next;
-			kfree(head);
-		}
-		mm->save= NULL;
-		mm->saved_context = 0; 
-	}
-	else
-	{
-		return -EINVAL;
-	}
-	kfree(buf);
-	return 0;
-}
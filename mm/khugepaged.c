@@ -15,6 +15,7 @@
 #include <linux/mman.h>
 #include <linux/hashtable.h>
 #include <linux/userfaultfd_k.h>
+#include <linux/mmcontext.h>
 #include <linux/page_idle.h>
 #include <linux/page_table_check.h>
 #include <linux/swapops.h>
@@ -51,6 +52,7 @@ enum scan_result {
 	SCAN_CGROUP_CHARGE_FAIL,
 	SCAN_TRUNCATED,
 	SCAN_PAGE_HAS_PRIVATE,
+	SCAN_CHECKPOINT,
 };
 
 #define CREATE_TRACE_POINTS
@@ -77,6 +79,13 @@ static DECLARE_WAIT_QUEUE_HEAD(khugepaged_wait);
 static unsigned int khugepaged_max_ptes_none __read_mostly;
 static unsigned int khugepaged_max_ptes_swap __read_mostly;
 static unsigned int khugepaged_max_ptes_shared __read_mostly;
+/*
+ * By default a range under an mmcontext checkpoint is collapsed if the
+ * checkpoint has saved none of it yet, and the huge pmd write-protected
+ * for it in turn. With checkpoint_defer set, the memory of an mm with a
+ * checkpoint active is left alone until the checkpoint is gone.
+ */
+static bool khugepaged_checkpoint_defer __read_mostly;
 
 #define MM_SLOTS_HASH_BITS 10
 static __read_mostly DEFINE_HASHTABLE(mm_slots_hash, MM_SLOTS_HASH_BITS);
@@ -318,11 +327,36 @@ static ssize_t max_ptes_shared_store(struct kobject *kobj,
 static struct kobj_attribute khugepaged_max_ptes_shared_attr =
 	__ATTR_RW(max_ptes_shared);
 
+static ssize_t checkpoint_defer_show(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     char *buf)
+{
+	return sysfs_emit(buf, "%d\n", khugepaged_checkpoint_defer);
+}
+
+static ssize_t checkpoint_defer_store(struct kobject *kobj,
+				      struct kobj_attribute *attr,
+				      const char *buf, size_t count)
+{
+	bool checkpoint_defer;
+
+	if (kstrtobool(buf, &checkpoint_defer))
+		return -EINVAL;
+
+	khugepaged_checkpoint_defer = checkpoint_defer;
+
+	return count;
+}
+
+static struct kobj_attribute khugepaged_checkpoint_defer_attr =
+	__ATTR_RW(checkpoint_defer);
+
 static struct attribute *khugepaged_attr[] = {
 	&khugepaged_defrag_attr.attr,
 	&khugepaged_max_ptes_none_attr.attr,
 	&khugepaged_max_ptes_swap_attr.attr,
 	&khugepaged_max_ptes_shared_attr.attr,
+	&khugepaged_checkpoint_defer_attr.attr,
 	&pages_to_scan_attr.attr,
 	&pages_collapsed_attr.attr,
 	&full_scans_attr.attr,
@@ -543,14 +577,28 @@ static bool is_refcount_suitable(struct page *page)
 	return page_count(page) == expected_refcount;
 }
 
+/*
+ * Collapse a range with ptes write-protected by an mmcontext checkpoint
+ * only if they all are, and none of them has been saved yet: the huge pmd
+ * is then write-protected in turn, and the first write splits it again to
+ * save the page written. Some saved, the huge pmd could neither leave the
+ * others unprotected nor have the saved ones saved a second time.
+ */
+static bool khugepaged_checkpoint_wp(int wp, int none_or_zero)
+{
+	return !wp || wp + none_or_zero == HPAGE_PMD_NR;
+}
+
 static int __collapse_huge_page_isolate(struct vm_area_struct *vma,
 					unsigned long address,
 					pte_t *pte,
-					struct list_head *compound_pagelist)
+					struct list_head *compound_pagelist,
+					bool *uffd_wp)
 {
 	struct page *page = NULL;
 	pte_t *_pte;
 	int none_or_zero = 0, shared = 0, result = 0, referenced = 0;
+	int wp = 0;
 	bool writable = false;
 
 	for (_pte = pte; _pte < pte + HPAGE_PMD_NR;
@@ -571,6 +619,14 @@ static int __collapse_huge_page_isolate(struct vm_area_struct *vma,
 			result = SCAN_PTE_NON_PRESENT;
 			goto out;
 		}
+		/* A checkpoint may have been taken since the scan. */
+		if (pte_uffd_wp(pteval)) {
+			if (!mmcontext_vma_wp(vma)) {
+				result = SCAN_PTE_UFFD_WP;
+				goto out;
+			}
+			wp++;
+		}
 		page = vm_normal_page(vma, address, pteval);
 		if (unlikely(!page) || unlikely(is_zone_device_page(page))) {
 			result = SCAN_PAGE_NULL;
@@ -652,16 +708,20 @@ static int __collapse_huge_page_isolate(struct vm_area_struct *vma,
 		    mmu_notifier_test_young(vma->vm_mm, address))
 			referenced++;
 
-		if (pte_write(pteval))
+		/* Write-protected by the checkpoint only. */
+		if (pte_write(pteval) || pte_uffd_wp(pteval))
 			writable = true;
 	}
 
-	if (unlikely(!writable)) {
+	if (unlikely(!khugepaged_checkpoint_wp(wp, none_or_zero))) {
+		result = SCAN_PTE_UFFD_WP;
+	} else if (unlikely(!writable)) {
 		result = SCAN_PAGE_RO;
 	} else if (unlikely(!referenced)) {
 		result = SCAN_LACK_REFERENCED_PAGE;
 	} else {
 		result = SCAN_SUCCEED;
+		*uffd_wp = wp;
 		trace_mm_collapse_huge_page_isolate(page, none_or_zero,
 						    referenced, writable, result);
 		return 1;
@@ -1008,6 +1068,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	int isolated = 0, result = 0;
 	struct vm_area_struct *vma;
 	struct mmu_notifier_range range;
+	bool uffd_wp = false;
 	gfp_t gfp;
 
 	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
@@ -1071,6 +1132,10 @@ static void collapse_huge_page(struct mm_struct *mm,
 	/* check if the pmd is still valid */
 	if (mm_find_pmd(mm, address) != pmd)
 		goto out_up_write;
+	if (khugepaged_checkpoint_defer && mm->saved_context) {
+		result = SCAN_CHECKPOINT;
+		goto out_up_write;
+	}
 
 	anon_vma_lock_write(vma->anon_vma);
 
@@ -1097,7 +1162,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 
 	spin_lock(pte_ptl);
 	isolated = __collapse_huge_page_isolate(vma, address, pte,
-			&compound_pagelist);
+			&compound_pagelist, &uffd_wp);
 	spin_unlock(pte_ptl);
 
 	if (unlikely(!isolated)) {
@@ -1136,6 +1201,8 @@ static void collapse_huge_page(struct mm_struct *mm,
 
 	_pmd = mk_huge_pmd(new_page, vma->vm_page_prot);
 	_pmd = maybe_pmd_mkwrite(pmd_mkdirty(_pmd), vma);
+	if (uffd_wp)
+		_pmd = pmd_mkuffd_wp(pmd_wrprotect(_pmd));
 
 	spin_lock(pmd_ptl);
 	BUG_ON(!pmd_none(*pmd));
@@ -1167,7 +1234,7 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 	pmd_t *pmd;
 	pte_t *pte, *_pte;
 	int ret = 0, result = 0, referenced = 0;
-	int none_or_zero = 0, shared = 0;
+	int none_or_zero = 0, shared = 0, wp = 0;
 	struct page *page = NULL;
 	unsigned long _address;
 	spinlock_t *ptl;
@@ -1176,6 +1243,11 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 
 	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
 
+	if (khugepaged_checkpoint_defer && READ_ONCE(mm->saved_context)) {
+		result = SCAN_CHECKPOINT;
+		goto out;
+	}
+
 	pmd = mm_find_pmd(mm, address);
 	if (!pmd) {
 		result = SCAN_PMD_NULL;
@@ -1195,8 +1267,11 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 				 * comment below for pte_uffd_wp().
 				 */
 				if (pte_swp_uffd_wp(pteval)) {
-					result = SCAN_PTE_UFFD_WP;
-					goto out_unmap;
+					if (!mmcontext_vma_wp(vma)) {
+						result = SCAN_PTE_UFFD_WP;
+						goto out_unmap;
+					}
+					wp++;
 				}
 				continue;
 			} else {
@@ -1224,11 +1299,18 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 			 * marked but that could bring unknown
 			 * userfault messages that falls outside of
 			 * the registered range.  So, just be simple.
+			 *
+			 * The write protection of an mmcontext checkpoint
+			 * is carried over instead, if it covers the whole
+			 * range, see khugepaged_checkpoint_wp().
 			 */
-			result = SCAN_PTE_UFFD_WP;
-			goto out_unmap;
+			if (!mmcontext_vma_wp(vma)) {
+				result = SCAN_PTE_UFFD_WP;
+				goto out_unmap;
+			}
+			wp++;
 		}
-		if (pte_write(pteval))
+		if (pte_write(pteval) || pte_uffd_wp(pteval))
 			writable = true;
 
 		page = vm_normal_page(vma, _address, pteval);
@@ -1297,7 +1379,9 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 		    mmu_notifier_test_young(vma->vm_mm, address))
 			referenced++;
 	}
-	if (!writable) {
+	if (!khugepaged_checkpoint_wp(wp, none_or_zero)) {
+		result = SCAN_PTE_UFFD_WP;
+	} else if (!writable) {
 		result = SCAN_PAGE_RO;
 	} else if (!referenced || (unmapped && referenced < HPAGE_PMD_NR/2)) {
 		result = SCAN_LACK_REFERENCED_PAGE;
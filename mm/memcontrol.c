@@ -1488,6 +1488,11 @@ static const unsigned int memcg_vm_event_stat[] = {
 	THP_FAULT_ALLOC,
 	THP_COLLAPSE_ALLOC,
 #endif
+#ifdef CONFIG_MMU
+	CKPT_PROTECT,
+	CKPT_COW_SAVE,
+	CKPT_RESTORE_PAGES,
+#endif
 };
 
 static void memory_stat_format(struct mem_cgroup *memcg, char *buf, int bufsize)
@@ -5272,11 +5277,13 @@ mem_cgroup_css_alloc(struct cgroup_subsys_state *parent_css)
 		page_counter_init(&memcg->swap, &parent->swap);
 		page_counter_init(&memcg->kmem, &parent->kmem);
 		page_counter_init(&memcg->tcpmem, &parent->tcpmem);
+		page_counter_init(&memcg->checkpoint, &parent->checkpoint);
 	} else {
 		page_counter_init(&memcg->memory, NULL);
 		page_counter_init(&memcg->swap, NULL);
 		page_counter_init(&memcg->kmem, NULL);
 		page_counter_init(&memcg->tcpmem, NULL);
+		page_counter_init(&memcg->checkpoint, NULL);
 
 		root_mem_cgroup = memcg;
 		return &memcg->css;
@@ -6532,6 +6539,37 @@ static ssize_t memory_reclaim(struct kernfs_open_file *of, char *buf,
 	return nbytes;
 }
 
+static u64 memory_checkpoint_current_read(struct cgroup_subsys_state *css,
+					  struct cftype *cft)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_css(css);
+
+	return (u64)page_counter_read(&memcg->checkpoint) * PAGE_SIZE;
+}
+
+static int memory_checkpoint_max_show(struct seq_file *m, void *v)
+{
+	return seq_puts_memcg_tunable(m,
+		READ_ONCE(mem_cgroup_from_seq(m)->checkpoint.max));
+}
+
+static ssize_t memory_checkpoint_max_write(struct kernfs_open_file *of,
+					   char *buf, size_t nbytes, loff_t off)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_css(of_css(of));
+	unsigned long max;
+	int err;
+
+	buf = strstrip(buf);
+	err = page_counter_memparse(buf, "max", &max);
+	if (err)
+		return err;
+
+	xchg(&memcg->checkpoint.max, max);
+
+	return nbytes;
+}
+
 static struct cftype memory_files[] = {
 	{
 		.name = "current",
@@ -6600,6 +6638,17 @@ static struct cftype memory_files[] = {
 		.flags = CFTYPE_NS_DELEGATABLE,
 		.write = memory_reclaim,
 	},
+	{
+		.name = "checkpoint.current",
+		.flags = CFTYPE_NOT_ON_ROOT,
+		.read_u64 = memory_checkpoint_current_read,
+	},
+	{
+		.name = "checkpoint.max",
+		.flags = CFTYPE_NOT_ON_ROOT,
+		.seq_show = memory_checkpoint_max_show,
+		.write = memory_checkpoint_max_write,
+	},
 	{ }	/* terminate */
 };
 
@@ -7152,6 +7201,38 @@ void mem_cgroup_uncharge_skmem(struct mem_cgroup *memcg, unsigned int nr_pages)
 	refill_stock(memcg, nr_pages);
 }
 
+/**
+ * mem_cgroup_charge_checkpoint - charge a sys_mmcontext() checkpoint
+ * @memcg: memcg to charge, may be NULL
+ * @nr_pages: number of pages the checkpoint may save
+ *
+ * Charges @nr_pages to the checkpoint budget of @memcg and its ancestors,
+ * memory.checkpoint.max. This only limits how much checkpoint data a
+ * cgroup may hold; the memory behind it is charged as usual. Returns
+ * %true if the charge fit within the budget, %false if it doesn't.
+ */
+bool mem_cgroup_charge_checkpoint(struct mem_cgroup *memcg,
+				  unsigned long nr_pages)
+{
+	struct page_counter *fail;
+
+	if (!memcg)
+		return true;
+	return page_counter_try_charge(&memcg->checkpoint, nr_pages, &fail);
+}
+
+/**
+ * mem_cgroup_uncharge_checkpoint - uncharge a sys_mmcontext() checkpoint
+ * @memcg: memcg to uncharge, may be NULL
+ * @nr_pages: number of pages to uncharge
+ */
+void mem_cgroup_uncharge_checkpoint(struct mem_cgroup *memcg,
+				    unsigned long nr_pages)
+{
+	if (memcg)
+		page_counter_uncharge(&memcg->checkpoint, nr_pages);
+}
+
 static int __init cgroup_memory(char *s)
 {
 	char *token;
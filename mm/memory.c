@@ -42,6 +42,7 @@
 #include <linux/kernel_stat.h>
 #include <linux/mm.h>
 #include <linux/mm_inline.h>
+#include <linux/mmcontext.h>
 #include <linux/sched/mm.h>
 #include <linux/sched/coredump.h>
 #include <linux/sched/numa_balancing.h>
@@ -3373,6 +3374,27 @@ static vm_fault_t do_wp_page(struct vm_fault *vmf)
 			return handle_userfault(vmf, VM_UFFD_WP);
 		}
 
+		/*
+		 * Or for a checkpoint that has not saved this page yet. The
+		 * save clears the uffd-wp bit and leaves the pte read-only,
+		 * for the write to carry on here.
+		 */
+		if (mmcontext_pte_wp(vma, *vmf->pte)) {
+			vm_fault_t ret;
+
+			pte_unmap_unlock(vmf->pte, vmf->ptl);
+			ret = mmcontext_save_page(vmf);
+			if (ret)
+				return ret;
+			vmf->pte = pte_offset_map_lock(vma->vm_mm, vmf->pmd,
+						       vmf->address, &vmf->ptl);
+			if (!pte_same(*vmf->pte, vmf->orig_pte)) {
+				update_mmu_tlb(vma, vmf->address, vmf->pte);
+				pte_unmap_unlock(vmf->pte, vmf->ptl);
+				return 0;
+			}
+		}
+
 		/*
 		 * Userfaultfd write-protect can defer flushes. Ensure the TLB
 		 * is flushed in this case before copying.
@@ -4795,6 +4817,9 @@ static inline vm_fault_t wp_huge_pmd(struct vm_fault *vmf)
 		if (likely(!unshare) &&
 		    userfaultfd_huge_pmd_wp(vmf->vma, vmf->orig_pmd))
 			return handle_userfault(vmf, VM_UFFD_WP);
+		if (likely(!unshare) &&
+		    mmcontext_huge_pmd_wp(vmf->vma, vmf->orig_pmd))
+			goto split;
 		return do_huge_pmd_wp_page(vmf);
 	}
 	if (vmf->vma->vm_ops->huge_fault) {
@@ -4804,7 +4829,11 @@ static inline vm_fault_t wp_huge_pmd(struct vm_fault *vmf)
 			return ret;
 	}
 
-	/* COW or write-notify handled on pte level: split pmd. */
+split:
+	/*
+	 * COW, write-notify or a checkpoint save handled on pte level: split
+	 * pmd. The split carries the uffd-wp bit over to every pte.
+	 */
 	__split_huge_pmd(vmf->vma, vmf->pmd, vmf->address, false, NULL);
 
 	return VM_FAULT_FALLBACK;
@@ -4896,42 +4925,7 @@ static vm_fault_t handle_pte_fault(struct vm_fault *vmf)
 		vmf->orig_pte = *vmf->pte;
 		vmf->flags |= FAULT_FLAG_ORIG_PTE_VALID;
 
-		if (!pte_write(vmf->orig_pte))
-		{
-			if(vma_is_anonymous(vmf->vma) && current->mm->saved_context)
-			{
-		struct mm_struct *mm = current->mm;
-		struct file *fp = mm->fp;
-		unsigned long int vpage = vmf->address;
-		char *buf = kmalloc(PAGE_SIZE, GFP_KERNEL); 
-		struct saved_page *new = kmalloc(sizeof(struct saved_page),GFP_KERNEL);
-		int X;
-		loff_t *offset = &(mm->offset);
-		pte_t new_pte = pte_mkwrite(*(vmf->pte));
-		flush_tlb_page(vmf->vma, vmf->address);
-		set_pte_at(mm,vpage,vmf->pte,new_pte);
-		//printk("atomic context %d",in_atomic());
-		new->next = NULL;
-		new->vpage = vpage;
-		if(mm->save_curr==NULL)
-		{
-			mm->save_curr=new;
-			mm->save = new;
-		}
-		else
-		{
-			mm->save_curr->next=new;
-			mm->save_curr=new;
-		}
-		//make the page writable
-		//flush_tlb_mm(mm);
-		
-		//update_mmu_tlb(vmf->vma,vmf->address,vmf->pte);
-		X=copy_from_user(buf,(void *)vpage, PAGE_SIZE);
-		kernel_write(fp, buf,PAGE_SIZE,offset);
-		kfree(buf);
-	}
-		}		/*
+		/*
 		 * some architectures can have larger ptes than wordsize,
 		 * e.g.ppc44x-defconfig has CONFIG_PTE_64BIT=y and
 		 * CONFIG_32BIT=y, so READ_ONCE cannot guarantee atomic
@@ -0,0 +1,2967 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *	mm/mmcontext.c
+ *
+ *	Checkpoint and restore of anonymous memory.
+ *
+ *	sys_mmcontext(MMCONTEXT_CHECKPOINT) write-protects the anonymous
+ *	memory of the caller (the stack excepted) with the uffd-wp pte bit,
+ *	through the same change_protection() path as UFFDIO_WRITEPROTECT.
+ *	The first write fault on such a page copies the old contents to the
+ *	checkpoint file in the kernel, without a userfaultfd handler, before
+ *	making the page writable again, see mmcontext_save_page().
+ *	sys_mmcontext(MMCONTEXT_RESTORE) reads all saved pages back.
+ *
+ *	sys_mmcontext(MMCONTEXT_CHECKPOINT_SOFT_DIRTY) copies the pages out
+ *	up front instead and tracks writes with the soft-dirty bit, see
+ *	mmcontext_sd_save().
+ */
+
+#include <linux/mm.h>
+#include <linux/mmcontext.h>
+#include <linux/bvec.h>
+#include <linux/cred.h>
+#include <linux/fs.h>
+#include <linux/fadvise.h>
+#include <linux/highmem.h>
+#include <linux/list_lru.h>
+#include <linux/pagemap.h>
+#include <linux/refcount.h>
+#include <linux/rmap.h>
+#include <linux/shrinker.h>
+#include <linux/ktime.h>
+#include <linux/bsearch.h>
+#include <linux/memcontrol.h>
+#include <linux/migrate.h>
+#include <linux/mmu_notifier.h>
+#include <linux/moduleparam.h>
+#include <linux/mount.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/swapops.h>
+#include <linux/syscalls.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmstat.h>
+#include <linux/workqueue.h>
+
+#include <asm/tlb.h>
+#include <asm/tlbflush.h>
+
+#include "internal.h"
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/mmcontext.h>
+
+/*
+ * Pages staged per checkpoint file write, and read back per read on
+ * restore.
+ */
+#define MMCONTEXT_BATCH	64
+
+/* Full batches a checkpoint may hold in memory before writing them out. */
+#define MMCONTEXT_HELD_MAX	256
+
+/*
+ * A batch of staged pages, and the file offset each belongs at. All its
+ * memory is on node @nid, that of the CPU that started it. A full batch
+ * set aside is on mmcontext_held_lru as well, for the shrinker.
+ */
+struct mmcontext_batch {
+	struct list_head list;
+	struct list_head lru;
+	struct mmcontext_stage *st;
+	unsigned int nr;
+	int nid;
+	struct page *pages[MMCONTEXT_BATCH];
+	struct bio_vec bvec[MMCONTEXT_BATCH];
+	loff_t pos[MMCONTEXT_BATCH];
+};
+
+/*
+ * Staging buffer between the fault path and the checkpoint file. Saved
+ * pages are copied into the @cur batch. When it is full it is set aside
+ * on @held and a new one started, as long as memory can be had without
+ * reclaim, up to MMCONTEXT_HELD_MAX; otherwise the oldest batch is
+ * written out and reused, and on restore all of them are, with O_DIRECT
+ * when the filesystem supports it, so checkpoint data does not go through
+ * the page cache. Runs of contiguous offsets go out in a single write.
+ * So while memory is plentiful a write fault only costs a copy. A new
+ * batch is allocated on the node of the faulting CPU, so that the copy
+ * does not cross sockets. Under memory pressure on a node, or in the
+ * memcg, the shrinker writes out and frees the batches held there, see
+ * mmcontext_shrink_scan(); a write error there is kept in @err for
+ * restore to report.
+ *
+ * Checkpoint memory belongs to @memcg, the memcg of the mm: the stage,
+ * saved page list and layout are __GFP_ACCOUNT, and checkpoint file I/O
+ * runs with @memcg active, so that page cache of a buffered file is
+ * charged to it too rather than to whoever does the I/O. @charged pages
+ * are held against its memory.checkpoint.max.
+ *
+ * Staged pages can be held for as long as the checkpoint lasts, so they
+ * are allocated movable and compaction may move them, see
+ * mmcontext_stage_migrate(). Every use of them is under @lock, but for
+ * restore, which copies them out to user memory once @restoring is set.
+ *
+ * Pages MADV_DONTNEED or MADV_FREE took away before they were saved are
+ * held on @zapped as they are, see __mmcontext_zap().
+ *
+ * @lock also serialises the saved page list and mm->offset.
+ *
+ * Write faults find the stage through mm->stage with only the mmap_lock
+ * held for read, and take @lock under it, so it is only taken out of
+ * there, to be freed or restored from, with the mmap_lock held for write,
+ * once no fault can be using it any more, see mmcontext_stage_take() and
+ * mmcontext_restore(). Nothing that holds @lock may take the mmap_lock,
+ * as a copy to or from user memory can. The shrinker
+ * finds it through its held batches on mmcontext_held_lru instead, and
+ * holds a reference in @ref for as long as it uses it, see
+ * mmcontext_stage_put().
+ */
+struct mmcontext_stage {
+	struct mutex lock;
+	refcount_t ref;
+	struct mmcontext_batch *cur;
+	struct list_head held;		/* full batches, oldest first */
+	unsigned int nr_held;
+	int err;
+	bool restoring;			/* batches in use without @lock */
+	struct mm_struct *mm;
+	struct mem_cgroup *memcg;
+	unsigned long charged;
+	struct list_head zapped;
+};
+
+/*
+ * The held batches of all checkpoints, oldest first, per node and per
+ * memcg of their stage: a batch is allocated with the stage's memcg
+ * active, see mmcontext_batch_alloc().
+ */
+static struct list_lru mmcontext_held_lru;
+
+/*
+ * A vma as a checkpoint knows it: by anon_vma and the range of linear
+ * page indexes it maps, as struct saved_page, rather than by address.
+ * @start is where it was mapped when it was looked at, @base its stretch
+ * of the checkpoint file in the fixed layout.
+ */
+struct mmcontext_region {
+	struct anon_vma *anon_vma;
+	pgoff_t pgoff;
+	pgoff_t end;
+	unsigned long start;
+	loff_t base;
+};
+
+/*
+ * Fixed checkpoint file layout, MMCONTEXT_FIXED_LAYOUT: every vma covered
+ * by the checkpoint gets its own stretch of the file, in address order,
+ * and a page is saved at base + (pgoff - region pgoff) pages in its
+ * region's stretch. Any saved page can be found without an index, and
+ * the file is sparse, so a hole is a page that was not saved. Pages
+ * outside the layout, in vmas that were not there at checkpoint time,
+ * are appended past @size and listed in mm->saved_pages as usual.
+ *
+ * Restore looks the saved pages up in a layout of the vmas as they are by
+ * then, to find the addresses they are mapped at now. The regions are
+ * sorted by anon_vma and page index, and each holds a reference to its
+ * anon_vma.
+ */
+struct mmcontext_layout {
+	unsigned int nr;
+	loff_t size;
+	struct mmcontext_region regions[];
+};
+
+/*
+ * Each process checkpoints to its own unnamed O_TMPFILE file in
+ * mmcontext.dir=, / by default. Point it at a filesystem mounted with
+ * -o dax to get the DAX backend.
+ */
+static char mmcontext_dir[256];
+module_param_string(dir, mmcontext_dir, sizeof(mmcontext_dir), 0644);
+MODULE_PARM_DESC(dir, "Directory for checkpoint files");
+
+/*
+ * Staged pages and golden image copies are non-lru movable pages: page
+ * private points to their owner, the batch or the golden image, and
+ * page->index is their slot in it. An owner frees them with the page
+ * locked, so a page under migration cannot be freed, and a page freed
+ * before its migration started is seen as such by the VM.
+ */
+static void mmcontext_page_own(struct page *page,
+			       const struct movable_operations *mops,
+			       void *owner, unsigned long index)
+{
+	lock_page(page);
+	__SetPageMovable(page, mops);
+	set_page_private(page, (unsigned long)owner);
+	page->index = index;
+	unlock_page(page);
+}
+
+static void mmcontext_page_free(struct page *page)
+{
+	lock_page(page);
+	if (PageMovable(page))
+		__ClearPageMovable(page);
+	set_page_private(page, 0);
+	unlock_page(page);
+	put_page(page);
+}
+
+/* Hand the slot of @src over to @dst, which holds a copy of it by now. */
+static void mmcontext_page_replace(struct page *dst, struct page *src)
+{
+	__SetPageMovable(dst, page_movable_ops(src));
+	set_page_private(dst, page_private(src));
+	dst->index = src->index;
+	get_page(dst);
+
+	__ClearPageMovable(src);
+	set_page_private(src, 0);
+	put_page(src);
+}
+
+/*
+ * Charge @dst to @memcg, if @src is charged, before it takes the place of
+ * @src; the charge of @src goes when it is freed.
+ */
+static int mmcontext_page_charge(struct page *dst, struct page *src,
+				 struct mem_cgroup *memcg)
+{
+	struct mem_cgroup *old;
+	int ret;
+
+	if (!PageMemcgKmem(src))
+		return 0;
+	old = set_active_memcg(memcg);
+	ret = memcg_kmem_charge_page(dst, GFP_NOWAIT | __GFP_NOWARN, 0);
+	set_active_memcg(old);
+	return ret;
+}
+
+/* Nothing to take them off of: the owner finds them by slot. */
+static bool mmcontext_page_isolate(struct page *page, isolate_mode_t mode)
+{
+	return true;
+}
+
+static void mmcontext_page_putback(struct page *page)
+{
+}
+
+/*
+ * Move a staged page, unless its checkpoint is busy with the stage: it is
+ * then being copied to, written out, restored from or freed, and the move
+ * is retried later.
+ */
+static int mmcontext_stage_migrate(struct page *dst, struct page *src,
+				   enum migrate_mode mode)
+{
+	struct mmcontext_batch *b = (struct mmcontext_batch *)page_private(src);
+	struct mmcontext_stage *st = b->st;
+	int ret;
+
+	if (mode == MIGRATE_SYNC_NO_COPY)
+		return -EINVAL;
+	if (!mutex_trylock(&st->lock))
+		return -EAGAIN;
+	ret = st->restoring ? -EAGAIN :
+	      mmcontext_page_charge(dst, src, st->memcg);
+	if (ret) {
+		mutex_unlock(&st->lock);
+		return ret;
+	}
+	copy_highpage(dst, src);
+	b->pages[src->index] = dst;
+	b->bvec[src->index].bv_page = dst;
+	mmcontext_page_replace(dst, src);
+	mutex_unlock(&st->lock);
+	return MIGRATEPAGE_SUCCESS;
+}
+
+static const struct movable_operations mmcontext_stage_mops = {
+	.isolate_page = mmcontext_page_isolate,
+	.migrate_page = mmcontext_stage_migrate,
+	.putback_page = mmcontext_page_putback,
+};
+
+/* Free @b and its pages; once they are movable, under the stage lock. */
+static void mmcontext_batch_free(struct mmcontext_batch *b)
+{
+	int i;
+
+	for (i = 0; i < MMCONTEXT_BATCH; i++)
+		if (b->pages[i])
+			mmcontext_page_free(b->pages[i]);
+	kfree(b);
+}
+
+/* Allocate a batch for @st with @gfp on the local node. */
+static struct mmcontext_batch *
+mmcontext_batch_alloc(struct mmcontext_stage *st, gfp_t gfp)
+{
+	int nid = numa_mem_id();
+	struct mmcontext_batch *b;
+	struct mem_cgroup *old;
+	struct page *page;
+	int i;
+
+	old = set_active_memcg(st->memcg);
+	b = kzalloc_node(sizeof(*b), gfp, nid);
+	if (b) {
+		INIT_LIST_HEAD(&b->lru);
+		b->st = st;
+		b->nid = nid;
+	}
+	for (i = 0; b && i < MMCONTEXT_BATCH; i++) {
+		page = alloc_pages_node(nid, gfp | __GFP_HIGHMEM |
+					__GFP_MOVABLE, 0);
+		if (!page) {
+			mmcontext_batch_free(b);
+			b = NULL;
+			break;
+		}
+		b->pages[i] = page;
+		b->bvec[i].bv_page = page;
+		b->bvec[i].bv_len = PAGE_SIZE;
+		b->bvec[i].bv_offset = 0;
+	}
+	set_active_memcg(old);
+
+	/* Only a complete batch is handed to compaction. */
+	for (i = 0; b && i < MMCONTEXT_BATCH; i++)
+		mmcontext_page_own(b->pages[i], &mmcontext_stage_mops, b, i);
+	return b;
+}
+
+/* Set full batch @b aside in @st, or take it back out. */
+static void mmcontext_hold(struct mmcontext_stage *st,
+			   struct mmcontext_batch *b)
+{
+	list_add_tail(&b->list, &st->held);
+	WRITE_ONCE(st->nr_held, st->nr_held + 1);
+	list_lru_add(&mmcontext_held_lru, &b->lru);
+}
+
+static void mmcontext_unhold(struct mmcontext_stage *st,
+			     struct mmcontext_batch *b)
+{
+	list_del(&b->list);
+	WRITE_ONCE(st->nr_held, st->nr_held - 1);
+	list_lru_del(&mmcontext_held_lru, &b->lru);
+}
+
+/* Every anonymous page of @mm, resident or swapped out. */
+static unsigned long mmcontext_anon_pages(struct mm_struct *mm)
+{
+	return get_mm_counter(mm, MM_ANONPAGES) +
+	       get_mm_counter(mm, MM_SWAPENTS);
+}
+
+/*
+ * Charge the most a checkpoint of @mm can save from here on, all of its
+ * anonymous memory, to the checkpoint budget, so that a cgroup over
+ * budget fails the checkpoint up front rather than filling up the file
+ * and page cache.
+ */
+static int mmcontext_charge(struct mmcontext_stage *st)
+{
+	unsigned long nr = mmcontext_anon_pages(st->mm);
+
+	if (!mem_cgroup_charge_checkpoint(st->memcg, nr))
+		return -ENOMEM;
+	st->charged += nr;
+	return 0;
+}
+
+static struct kmem_cache *saved_page_cachep;
+
+/* Key @sp by the page at @addr in @vma, see struct saved_page. */
+static void saved_page_key(struct saved_page *sp, struct vm_area_struct *vma,
+			   unsigned long addr)
+{
+	sp->anon_vma = vma->anon_vma;
+	sp->pgoff = linear_page_index(vma, addr);
+	get_anon_vma(sp->anon_vma);
+}
+
+/* Free @sp once it has been keyed. */
+static void saved_page_free(struct saved_page *sp)
+{
+	put_anon_vma(sp->anon_vma);
+	kmem_cache_free(saved_page_cachep, sp);
+}
+
+/* Drop @nr references to @anon_vma at once. */
+static void saved_page_put_anon_vma(struct anon_vma *anon_vma,
+				    unsigned int nr)
+{
+	if (nr && atomic_sub_and_test(nr, &anon_vma->refcount))
+		__put_anon_vma(anon_vma);
+}
+
+/*
+ * Free every keyed entry on @head, which is left empty. Entries saved one
+ * after the other mostly share their anon_vma, so each run of them drops
+ * its references in one go, and the entries go back to the slab in bulk.
+ */
+static void saved_page_free_all(struct list_head *head)
+{
+	struct anon_vma *anon_vma = NULL;
+	struct saved_page *sp, *next;
+	unsigned int nr = 0, refs = 0;
+	void *bulk[16];
+
+	list_for_each_entry_safe(sp, next, head, list) {
+		if (sp->anon_vma != anon_vma) {
+			saved_page_put_anon_vma(anon_vma, refs);
+			anon_vma = sp->anon_vma;
+			refs = 0;
+		}
+		refs++;
+		bulk[nr++] = sp;
+		if (nr == ARRAY_SIZE(bulk)) {
+			kmem_cache_free_bulk(saved_page_cachep, nr, bulk);
+			nr = 0;
+		}
+	}
+	saved_page_put_anon_vma(anon_vma, refs);
+	if (nr)
+		kmem_cache_free_bulk(saved_page_cachep, nr, bulk);
+	INIT_LIST_HEAD(head);
+}
+
+/*
+ * Drop a reference to @st. The shrinker may still be in mutex_unlock()
+ * when mmcontext_stage_free() gets the lock after it, so the memory goes
+ * with the last reference rather than with the lock.
+ */
+static void mmcontext_stage_put(struct mmcontext_stage *st)
+{
+	if (refcount_dec_and_test(&st->ref))
+		kfree(st);
+}
+
+/* Free @st, and anything still staged in it. */
+static void mmcontext_stage_free(struct mmcontext_stage *st)
+{
+	struct mmcontext_batch *b, *next;
+	struct saved_page *sp;
+
+	/* The shrinker or compaction may still be at it. */
+	mutex_lock(&st->lock);
+	list_for_each_entry_safe(b, next, &st->held, list) {
+		mmcontext_unhold(st, b);
+		mmcontext_batch_free(b);
+	}
+	if (st->cur)
+		mmcontext_batch_free(st->cur);
+	mutex_unlock(&st->lock);
+	list_for_each_entry(sp, &st->zapped, list)
+		if (sp->page)
+			put_page(sp->page);
+	saved_page_free_all(&st->zapped);
+	mem_cgroup_uncharge_checkpoint(st->memcg, st->charged);
+	mem_cgroup_put(st->memcg);
+	mmcontext_stage_put(st);
+}
+
+/*
+ * Set up the stage of a new checkpoint of @mm and charge for it. It is
+ * only published in mm->stage once it is complete, so that nothing but
+ * the caller ever sees one that is freed again on failure.
+ */
+static int mmcontext_stage_alloc(struct mm_struct *mm)
+{
+	struct mmcontext_stage *st;
+	int ret = -ENOMEM;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL_ACCOUNT);
+	if (!st)
+		return -ENOMEM;
+	mutex_init(&st->lock);
+	refcount_set(&st->ref, 1);
+	INIT_LIST_HEAD(&st->held);
+	INIT_LIST_HEAD(&st->zapped);
+	st->mm = mm;
+	st->memcg = get_mem_cgroup_from_mm(mm);
+#ifdef CONFIG_MEMCG_KMEM
+	if (memcg_list_lru_alloc(st->memcg, &mmcontext_held_lru, GFP_KERNEL))
+		goto fail;
+#endif
+	st->cur = mmcontext_batch_alloc(st, GFP_KERNEL_ACCOUNT);
+	if (!st->cur)
+		goto fail;
+	ret = mmcontext_charge(st);
+	if (ret)
+		goto fail;
+
+	mm->stage = st;
+	return 0;
+fail:
+	mmcontext_stage_free(st);
+	return ret;
+}
+
+/*
+ * The counters in mm->ckpt_stats, which /proc/<pid>/checkpoint reads
+ * without any lock.
+ */
+#define mmcontext_stat_set(mm, item, val) \
+	WRITE_ONCE((mm)->ckpt_stats.item, (val))
+#define mmcontext_stat_add(mm, item, nr) \
+	mmcontext_stat_set(mm, item, (mm)->ckpt_stats.item + (nr))
+
+/*
+ * Count @nr @item events, globally and for @memcg, that of the stage or
+ * golden image: the fault path saves a page far too often to look the
+ * memcg of the mm up each time.
+ */
+static void mmcontext_count(struct mem_cgroup *memcg,
+			    enum vm_event_item item, unsigned long nr)
+{
+	count_vm_events(item, nr);
+	count_memcg_events(memcg, item, nr);
+}
+
+/*
+ * Read or write @nr pages of batch @b, from slot @first on, at @pos in
+ * the checkpoint file.
+ */
+static int mmcontext_stage_io(struct file *fp, struct mmcontext_batch *b,
+			      unsigned int first, unsigned int nr, loff_t pos,
+			      unsigned int rw)
+{
+	size_t len = (size_t)nr << PAGE_SHIFT;
+	struct iov_iter iter;
+	ssize_t ret;
+
+	iov_iter_bvec(&iter, rw, b->bvec + first, nr, len);
+	if (rw == WRITE)
+		ret = vfs_iter_write(fp, &iter, &pos, 0);
+	else
+		ret = vfs_iter_read(fp, &iter, &pos, 0);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EIO;
+}
+
+/*
+ * A checkpoint file on a DAX filesystem is persistent memory that its
+ * read and write paths memcpy to and from directly, see dax_iomap_rw().
+ * Pages then go straight between the process's memory and the file, with
+ * no stage copy, page cache or block layer in between.
+ */
+static bool mmcontext_dax(struct mm_struct *mm)
+{
+	return IS_DAX(file_inode(mm->fp));
+}
+
+/* Write @page at @pos in the file. */
+static int mmcontext_page_write(struct file *fp, struct page *page, loff_t pos)
+{
+	struct bio_vec bvec = {
+		.bv_page = page,
+		.bv_len = PAGE_SIZE,
+	};
+	struct iov_iter iter;
+	ssize_t ret;
+
+	iov_iter_bvec(&iter, WRITE, &bvec, 1, PAGE_SIZE);
+	ret = vfs_iter_write(fp, &iter, &pos, 0);
+	if (ret < 0)
+		return ret;
+	return ret == PAGE_SIZE ? 0 : -EIO;
+}
+
+/* Read or write @len bytes of user memory at @addr at @pos in the file. */
+static int mmcontext_user_io(struct file *fp, unsigned long addr, size_t len,
+			     loff_t pos, unsigned int rw)
+{
+	struct iov_iter iter;
+	struct iovec iov;
+	ssize_t ret;
+
+	ret = import_single_range(rw, (void __user *)addr, len, &iov, &iter);
+	if (ret)
+		return ret;
+	if (rw == WRITE)
+		ret = vfs_iter_write(fp, &iter, &pos, 0);
+	else
+		ret = vfs_iter_read(fp, &iter, &pos, 0);
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EIO;
+}
+
+/* Commit the next stage slot, to be written out at @pos. */
+static void mmcontext_stage_add(struct mmcontext_stage *st, loff_t pos)
+{
+	st->cur->pos[st->cur->nr++] = pos;
+}
+
+/* Write out the pages staged in @b and empty it. */
+static int mmcontext_batch_write(struct mmcontext_stage *st,
+				 struct mmcontext_batch *b)
+{
+	struct mm_struct *mm = st->mm;
+	unsigned int nr = b->nr, i, run;
+	size_t len;
+	u64 start;
+	int ret = 0;
+
+	b->nr = 0;
+	for (i = 0; i < nr && !ret; i += run) {
+		for (run = 1; i + run < nr; run++)
+			if (b->pos[i + run] !=
+			    b->pos[i] + ((loff_t)run << PAGE_SHIFT))
+				break;
+		len = (size_t)run << PAGE_SHIFT;
+		start = ktime_get_ns();
+		ret = mmcontext_stage_io(mm->fp, b, i, run, b->pos[i], WRITE);
+		trace_mmcontext_flush(mm, b->pos[i], len,
+				      ktime_get_ns() - start, ret);
+		if (!ret)
+			mmcontext_stat_add(mm, bytes_written, len);
+	}
+	return ret;
+}
+
+/* Write out everything staged in @st, the held batches first. */
+static int mmcontext_flush(struct mmcontext_stage *st)
+{
+	struct mmcontext_batch *b, *next;
+	struct mem_cgroup *old;
+	int ret;
+
+	old = set_active_memcg(st->memcg);
+	list_for_each_entry_safe(b, next, &st->held, list) {
+		ret = mmcontext_batch_write(st, b);
+		if (ret && !st->err)
+			st->err = ret;
+		mmcontext_unhold(st, b);
+		mmcontext_batch_free(b);
+	}
+	ret = mmcontext_batch_write(st, st->cur);
+	if (ret && !st->err)
+		st->err = ret;
+	set_active_memcg(old);
+	return st->err;
+}
+
+/*
+ * Make room in the stage for another page: set a full batch aside and
+ * start a new one, or if that cannot be had write out the oldest batch
+ * and start over in it. Only one batch is written with the lock held, so
+ * a write fault never waits for more than MMCONTEXT_BATCH pages of I/O.
+ * Held batches go out oldest first, so a later copy of a page is never
+ * overwritten by an earlier one.
+ */
+static int mmcontext_stage_room(struct mmcontext_stage *st)
+{
+	struct mmcontext_batch *b;
+	struct mem_cgroup *old;
+	int ret;
+
+	if (st->cur->nr < MMCONTEXT_BATCH)
+		return 0;
+	if (st->nr_held < MMCONTEXT_HELD_MAX) {
+		b = mmcontext_batch_alloc(st, GFP_NOWAIT | __GFP_NOWARN |
+					      __GFP_ACCOUNT);
+		if (b) {
+			mmcontext_hold(st, st->cur);
+			st->cur = b;
+			return 0;
+		}
+	}
+
+	b = list_first_entry_or_null(&st->held, struct mmcontext_batch, list);
+	old = set_active_memcg(st->memcg);
+	ret = mmcontext_batch_write(st, b ?: st->cur);
+	set_active_memcg(old);
+	if (ret) {
+		if (!st->err)
+			st->err = ret;
+		return ret;
+	}
+	if (b) {
+		mmcontext_unhold(st, b);
+		mmcontext_hold(st, st->cur);
+		st->cur = b;
+	}
+	return 0;
+}
+
+static unsigned long mmcontext_shrink_count(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	return list_lru_shrink_count(&mmcontext_held_lru, sc) *
+	       MMCONTEXT_BATCH ?: SHRINK_EMPTY;
+}
+
+/*
+ * Write out and free held batch @item, unless its stage is busy saving a
+ * page or being restored. Nothing needs writing for an mm that is gone.
+ */
+static enum lru_status mmcontext_spill(struct list_head *item,
+				       struct list_lru_one *list,
+				       spinlock_t *lock, void *arg)
+{
+	struct mmcontext_batch *b = container_of(item, typeof(*b), lru);
+	struct mmcontext_stage *st = b->st;
+	unsigned long *freed = arg;
+	struct mem_cgroup *old;
+	int ret;
+
+	if (!mutex_trylock(&st->lock))
+		return LRU_SKIP;
+	/* A batch on the list keeps its stage from being freed. */
+	list_lru_isolate(list, item);
+	refcount_inc(&st->ref);
+	spin_unlock(lock);
+
+	if (atomic_read(&st->mm->mm_users)) {
+		old = set_active_memcg(st->memcg);
+		ret = mmcontext_batch_write(st, b);
+		set_active_memcg(old);
+		if (ret && !st->err)
+			st->err = ret;
+	}
+	mmcontext_unhold(st, b);
+	mmcontext_batch_free(b);
+	*freed += MMCONTEXT_BATCH;
+	mutex_unlock(&st->lock);
+	mmcontext_stage_put(st);
+
+	spin_lock(lock);
+	return LRU_REMOVED_RETRY;
+}
+
+/*
+ * Write out and free the batches held on the node and in the memcg under
+ * pressure, those held longest first.
+ */
+static unsigned long mmcontext_shrink_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	unsigned long nr = DIV_ROUND_UP(sc->nr_to_scan, MMCONTEXT_BATCH);
+	unsigned long freed = 0;
+
+	/* Writing the checkpoint file may recurse into the filesystem. */
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+
+	list_lru_walk_one(&mmcontext_held_lru, sc->nid, sc->memcg,
+			  mmcontext_spill, &freed, &nr);
+	return freed ?: SHRINK_STOP;
+}
+
+static struct shrinker mmcontext_shrinker = {
+	.count_objects = mmcontext_shrink_count,
+	.scan_objects = mmcontext_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+	.flags = SHRINKER_NUMA_AWARE | SHRINKER_MEMCG_AWARE,
+};
+
+/*
+ * Reserve file space from @pos on for @nr pages of @mm, the most a
+ * checkpoint can save. Writes from the fault path are then overwrites of
+ * allocated blocks, with no block allocation, journalling or i_size
+ * update, and a full filesystem fails the checkpoint up front rather than
+ * a write fault with SIGBUS later.
+ */
+static int mmcontext_reserve(struct mm_struct *mm, loff_t pos,
+			     unsigned long nr)
+{
+	loff_t len = (loff_t)nr << PAGE_SHIFT;
+	int ret;
+
+	mmcontext_stat_set(mm, reserved, 0);
+	if (!nr)
+		return 0;
+	ret = vfs_fallocate(mm->fp, 0, pos, len);
+	/* Without fallocate() the file just grows as pages are saved. */
+	if (ret == -EOPNOTSUPP)
+		return 0;
+	if (!ret)
+		mmcontext_stat_set(mm, reserved, len);
+	return ret;
+}
+
+/* The start of a struct mmcontext_region, to look one up by. */
+struct region_key {
+	struct anon_vma *anon_vma;
+	pgoff_t pgoff;
+};
+
+static int region_cmp(const void *key, const void *elt)
+{
+	const struct region_key *k = key;
+	const struct mmcontext_region *r = elt;
+
+	if (k->anon_vma != r->anon_vma)
+		return k->anon_vma < r->anon_vma ? -1 : 1;
+	if (k->pgoff < r->pgoff)
+		return -1;
+	return k->pgoff >= r->end;
+}
+
+/* The region of @layout page @pgoff of @anon_vma is in, or NULL. */
+static struct mmcontext_region *
+mmcontext_region_find(struct mmcontext_layout *layout,
+		      struct anon_vma *anon_vma, pgoff_t pgoff)
+{
+	struct region_key key = { anon_vma, pgoff };
+
+	if (!layout)
+		return NULL;
+	return bsearch(&key, layout->regions, layout->nr,
+		       sizeof(struct mmcontext_region), region_cmp);
+}
+
+/*
+ * Where the page at @addr in @vma is saved in the fixed layout, or -1 if
+ * it is outside it.
+ */
+static loff_t mmcontext_layout_offset(struct mmcontext_layout *layout,
+				      struct vm_area_struct *vma,
+				      unsigned long addr)
+{
+	pgoff_t pgoff = linear_page_index(vma, addr);
+	struct mmcontext_region *r;
+
+	r = mmcontext_region_find(layout, vma->anon_vma, pgoff);
+	return r ? r->base + ((loff_t)(pgoff - r->pgoff) << PAGE_SHIFT) : -1;
+}
+
+/*
+ * Called from do_wp_page(), with the pte unmapped and unlocked, on a write
+ * fault to a page that was write-protected by the checkpoint: stage the
+ * old contents for the checkpoint file and clear the uffd-wp bit. Every
+ * write-protect fault goes through do_wp_page(), that of a present pte
+ * from handle_pte_fault() and that of a page just swapped in, but still
+ * shared, from do_swap_page().
+ *
+ * The pte is left read-only. vmf->orig_pte is updated to match, so
+ * do_wp_page() carries straight on, and reuses a page exclusive to this
+ * mm through ptep_set_access_flags() and update_mmu_cache(), or breaks
+ * COW on one still shared with a child after fork(). Upgrading a pte
+ * needs no TLB shootdown: a CPU holding the stale read-only entry just
+ * faults again. Neither does clearing the uffd-wp bit, a software bit on
+ * a read-only pte.
+ */
+vm_fault_t mmcontext_save_page(struct vm_fault *vmf)
+{
+	struct mm_struct *mm = vmf->vma->vm_mm;
+	struct mmcontext_stage *st = mm->stage;
+	unsigned long vpage = vmf->address & PAGE_MASK;
+	u64 start = ktime_get_ns();
+	bool dax = mmcontext_dax(mm);
+	struct saved_page *new;
+	vm_fault_t ret = 0;
+	struct page *page;
+	pte_t old, entry;
+	loff_t offset;
+	bool saved;
+	u64 delta;
+	int err;
+
+	/* Allocated outside @lock, and freed again if the page needs none. */
+	new = kmem_cache_alloc(saved_page_cachep, GFP_KERNEL);
+	if (!new)
+		return VM_FAULT_OOM;
+
+	mutex_lock(&st->lock);
+	/* Not a write-protect checkpoint any more: nothing to save. */
+	if (mm->saved_context != MMCONTEXT_TRACK_WP)
+		goto unlock;
+	/*
+	 * A page in the fixed layout needs no list entry. The layout is
+	 * looked up only now, with @lock held and the checkpoint known to
+	 * be active, as it goes with the checkpoint.
+	 */
+	offset = mmcontext_layout_offset(mm->layout, vmf->vma, vpage);
+	if (offset < 0) {
+		offset = mm->offset;
+	} else {
+		kmem_cache_free(saved_page_cachep, new);
+		new = NULL;
+	}
+	if (dax) {
+		/*
+		 * Nothing is staged, the page goes to the file right away, so
+		 * check first that no other thread saved it, and so could
+		 * have written to it, already. Saves are serialised by
+		 * @st->lock, so it cannot happen once the check is done. The
+		 * page is written from a reference taken under the page table
+		 * lock, like the copy below, and no user memory is touched
+		 * under the file's locks.
+		 */
+		vmf->pte = pte_offset_map_lock(mm, vmf->pmd, vpage, &vmf->ptl);
+		saved = pte_same(*vmf->pte, vmf->orig_pte);
+		page = saved ? vm_normal_page(vmf->vma, vpage, vmf->orig_pte) :
+			       NULL;
+		if (page)
+			get_page(page);
+		pte_unmap_unlock(vmf->pte, vmf->ptl);
+		if (!saved)
+			goto unlock;
+		err = mmcontext_page_write(mm->fp, page ?: ZERO_PAGE(0), offset);
+		if (page)
+			put_page(page);
+		if (err)
+			goto sigbus;
+		mmcontext_stat_add(mm, bytes_written, PAGE_SIZE);
+	} else if (mmcontext_stage_room(st)) {
+		goto sigbus;
+	}
+
+	/*
+	 * The page is only saved if the pte still carries the bit: otherwise
+	 * another thread saved it first and may have written it since. The
+	 * copy is taken from the page the pte maps, under the page table
+	 * lock, not through the user address: the fault may be on behalf of
+	 * another task, through ptrace() or process_vm_writev(). A pte of the
+	 * zero page maps no normal page, and is saved as a page of zeroes.
+	 */
+	vmf->pte = pte_offset_map_lock(mm, vmf->pmd, vpage, &vmf->ptl);
+	saved = pte_same(*vmf->pte, vmf->orig_pte);
+	if (saved && !dax) {
+		page = vm_normal_page(vmf->vma, vpage, vmf->orig_pte);
+		if (page)
+			copy_highpage(st->cur->pages[st->cur->nr], page);
+		else
+			clear_highpage(st->cur->pages[st->cur->nr]);
+	}
+	if (saved) {
+		old = ptep_modify_prot_start(vmf->vma, vpage, vmf->pte);
+		entry = pte_clear_uffd_wp(old);
+		ptep_modify_prot_commit(vmf->vma, vpage, vmf->pte, old, entry);
+		vmf->orig_pte = entry;
+	}
+	pte_unmap_unlock(vmf->pte, vmf->ptl);
+	if (!saved)
+		goto unlock;
+
+	if (new) {
+		saved_page_key(new, vmf->vma, vpage);
+		new->offset = offset;
+		list_add_tail(&new->list, &mm->saved_pages);
+		mm->offset += PAGE_SIZE;
+	}
+	if (!dax)
+		mmcontext_stage_add(st, offset);
+	delta = ktime_get_ns() - start;
+	mmcontext_stat_add(mm, cow_saves, 1);
+	mmcontext_stat_add(mm, fault_ns, delta);
+	mutex_unlock(&st->lock);
+	mmcontext_count(st->memcg, CKPT_COW_SAVE, 1);
+	trace_mmcontext_cow_save(mm, vpage, offset, delta);
+	return 0;
+
+sigbus:
+	ret = VM_FAULT_SIGBUS;
+unlock:
+	mutex_unlock(&st->lock);
+	if (new)
+		kmem_cache_free(saved_page_cachep, new);
+	return ret;
+}
+
+/*
+ * The vmas a checkpoint covers: anonymous memory other than the stack,
+ * unless userspace tracks it with userfaultfd-wp itself.
+ */
+static bool mmcontext_vma(struct vm_area_struct *vma)
+{
+	struct mm_struct *mm = vma->vm_mm;
+
+	return vma_is_anonymous(vma) && !userfaultfd_wp(vma) &&
+	       !(mm->start_stack >= vma->vm_start &&
+		 mm->start_stack <= vma->vm_end);
+}
+
+/* Like mm_find_pmd(), but also returns a huge or migrating pmd. */
+static pmd_t *mmcontext_pmd(struct mm_struct *mm, unsigned long addr)
+{
+	pgd_t *pgd;
+	p4d_t *p4d;
+	pud_t *pud;
+
+	pgd = pgd_offset(mm, addr);
+	if (!pgd_present(*pgd))
+		return NULL;
+	p4d = p4d_offset(pgd, addr);
+	if (!p4d_present(*p4d))
+		return NULL;
+	pud = pud_offset(p4d, addr);
+	if (!pud_present(*pud) || pud_trans_huge(*pud))
+		return NULL;
+	return pmd_offset(pud, addr);
+}
+
+typedef int (*mmcontext_pte_fn)(struct vm_area_struct *vma,
+				unsigned long addr, pte_t *pte, void *priv);
+typedef int (*mmcontext_pmd_fn)(struct vm_area_struct *vma,
+				unsigned long addr, pmd_t *pmd, void *priv);
+
+/*
+ * Call @fn with the page table lock held for each present pte in the vmas
+ * a checkpoint covers, with the mmap_lock held, and @pmd_fn likewise for
+ * each THP mapped by a pmd. A page that is swapped out or migrating is
+ * faulted in, for every populated page to be seen. A THP is split, to be
+ * seen through its ptes, if there is no @pmd_fn or @pmd_fn returns 1.
+ * Stops at the first other non-zero return and returns it.
+ */
+static int mmcontext_walk(struct mm_struct *mm, mmcontext_pte_fn fn,
+			  mmcontext_pmd_fn pmd_fn, void *priv)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr, next;
+	pte_t *pte, *start_pte;
+	pmd_t *pmd, pmde;
+	spinlock_t *ptl;
+	int ret = 0;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!mmcontext_vma(vma))
+			continue;
+		for (addr = vma->vm_start; addr < vma->vm_end; addr = next) {
+			next = pmd_addr_end(addr, vma->vm_end);
+			pmd = mmcontext_pmd(mm, addr);
+			if (!pmd)
+				continue;
+			pmde = READ_ONCE(*pmd);
+			if (pmd_trans_huge(pmde) && pmd_fn) {
+				ptl = pmd_lock(mm, pmd);
+				ret = 1;
+				if (pmd_trans_huge(*pmd))
+					ret = pmd_fn(vma, addr, pmd, priv);
+				spin_unlock(ptl);
+				if (ret < 0)
+					return ret;
+				if (!ret) {
+					cond_resched();
+					continue;
+				}
+				ret = 0;
+				pmde = READ_ONCE(*pmd);
+			}
+			if (pmd_trans_huge(pmde) || is_pmd_migration_entry(pmde))
+				split_huge_pmd(vma, pmd, addr);
+			pmd = mm_find_pmd(mm, addr);
+			if (!pmd)
+				continue;
+			start_pte = pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+			for (; addr < next && !ret; pte++, addr += PAGE_SIZE) {
+				if (is_swap_pte(*pte))
+					break;
+				if (pte_present(*pte))
+					ret = fn(vma, addr, pte, priv);
+			}
+			pte_unmap_unlock(start_pte, ptl);
+			if (ret)
+				return ret;
+			if (addr < next) {
+				/* Fault it in and carry on from it. */
+				ret = fixup_user_fault(mm, addr, 0, NULL);
+				if (ret)
+					return ret;
+				next = addr;
+			}
+			cond_resched();
+		}
+	}
+	return 0;
+}
+
+/*
+ * Give every covered vma an anon_vma, the key of its saved pages, before
+ * any is saved: one with only the zero page mapped has none yet, and
+ * mremap() would not keep the page indexes of such a vma either.
+ */
+static int mmcontext_anon_prepare(struct mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next)
+		if (mmcontext_vma(vma) && anon_vma_prepare(vma))
+			return -ENOMEM;
+	return 0;
+}
+
+/* The vmas in a layout: the covered ones, or all with anonymous pages. */
+static bool mmcontext_layout_vma(struct vm_area_struct *vma, bool covered)
+{
+	if (!vma->anon_vma)
+		return false;
+	return covered ? mmcontext_vma(vma) : vma_is_anonymous(vma);
+}
+
+static int region_sort_cmp(const void *a, const void *b)
+{
+	const struct mmcontext_region *ra = a, *rb = b;
+
+	if (ra->anon_vma != rb->anon_vma)
+		return ra->anon_vma < rb->anon_vma ? -1 : 1;
+	if (ra->pgoff != rb->pgoff)
+		return ra->pgoff < rb->pgoff ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Lay out the vmas of @mm, only those a checkpoint covers if @covered,
+ * each with its stretch of the checkpoint file in address order.
+ */
+static struct mmcontext_layout *mmcontext_layout_alloc(struct mm_struct *mm,
+							bool covered)
+{
+	struct mmcontext_layout *layout;
+	struct mmcontext_region *r;
+	struct vm_area_struct *vma;
+	unsigned int nr = 0;
+	loff_t base = 0;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next)
+		if (mmcontext_layout_vma(vma, covered))
+			nr++;
+	layout = kvmalloc(struct_size(layout, regions, nr), GFP_KERNEL_ACCOUNT);
+	if (!layout)
+		return NULL;
+
+	layout->nr = 0;
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!mmcontext_layout_vma(vma, covered))
+			continue;
+		r = &layout->regions[layout->nr++];
+		r->anon_vma = vma->anon_vma;
+		get_anon_vma(r->anon_vma);
+		r->pgoff = vma->vm_pgoff;
+		r->end = vma->vm_pgoff + vma_pages(vma);
+		r->start = vma->vm_start;
+		r->base = base;
+		base += vma->vm_end - vma->vm_start;
+	}
+	layout->size = base;
+	sort(layout->regions, layout->nr, sizeof(*r), region_sort_cmp, NULL);
+	return layout;
+}
+
+/*
+ * Fail with -EBUSY if a page index of an anon_vma falls in two regions of
+ * @layout. A partial mremap(MREMAP_DONTUNMAP) leaves the vma it moved from with the
+ * anon_vma and page indexes of the one it moved to, and pages faulted in
+ * there since with the same keys as the moved ones. A checkpoint could
+ * not tell their saved pages apart, so it is refused; while one is
+ * active, mremap() refuses MREMAP_DONTUNMAP instead.
+ */
+static int mmcontext_layout_check(struct mmcontext_layout *layout)
+{
+	struct mmcontext_region *r = layout->regions;
+	unsigned int i;
+
+	for (i = 1; i < layout->nr; i++)
+		if (r[i].anon_vma == r[i - 1].anon_vma &&
+		    r[i].pgoff < r[i - 1].end)
+			return -EBUSY;
+	return 0;
+}
+
+static void mmcontext_layout_free(struct mmcontext_layout *layout)
+{
+	unsigned int i;
+
+	if (!layout)
+		return;
+	for (i = 0; i < layout->nr; i++)
+		put_anon_vma(layout->regions[i].anon_vma);
+	kvfree(layout);
+}
+
+/* Refuse a checkpoint of @mm if its covered vmas duplicate page keys. */
+static int mmcontext_keys_check(struct mm_struct *mm)
+{
+	struct mmcontext_layout *layout = mmcontext_layout_alloc(mm, true);
+	int ret;
+
+	if (!layout)
+		return -ENOMEM;
+	ret = mmcontext_layout_check(layout);
+	mmcontext_layout_free(layout);
+	return ret;
+}
+
+/*
+ * Find the address page @pgoff of @anon_vma is mapped at in @map, a
+ * layout of the vmas as they are now: false if it has been unmapped.
+ */
+static bool mmcontext_vaddr(struct mmcontext_layout *map,
+			    struct anon_vma *anon_vma, pgoff_t pgoff,
+			    unsigned long *addr)
+{
+	struct mmcontext_region *r;
+
+	r = mmcontext_region_find(map, anon_vma, pgoff);
+	if (!r)
+		return false;
+	*addr = r->start + ((pgoff - r->pgoff) << PAGE_SHIFT);
+	return true;
+}
+
+/*
+ * Empty the checkpoint file and size it for @layout, all holes. Restore
+ * tells saved pages from holes with SEEK_DATA, so the filesystem has to
+ * report holes, at page granularity at least.
+ */
+static int mmcontext_layout_file(struct file *fp,
+				 struct mmcontext_layout *layout)
+{
+	int ret;
+
+	if (file_inode(fp)->i_blkbits > PAGE_SHIFT)
+		return -EOPNOTSUPP;
+	ret = vfs_truncate(&fp->f_path, 0);
+	if (!ret)
+		ret = vfs_truncate(&fp->f_path, layout->size);
+	if (ret)
+		return ret;
+	/* Without SEEK_DATA support all of i_size reads as data. */
+	if (layout->size && vfs_llseek(fp, 0, SEEK_DATA) != -ENXIO)
+		return -EOPNOTSUPP;
+	return 0;
+}
+
+/*
+ * Pages pinned with FOLL_PIN, for io_uring fixed buffers, RDMA or VFIO,
+ * can be written by a device with no write fault to catch: a checkpoint
+ * saves them up front, and restore always copies them back.
+ */
+static bool mmcontext_pinned(struct page *page)
+{
+	return page && page_maybe_dma_pinned(page);
+}
+
+/*
+ * struct saved_page entries allocated ahead of taking a page table lock,
+ * one for each free slot in the stage.
+ */
+struct saved_page_pool {
+	struct list_head list;
+	unsigned int nr;
+};
+
+/* Have @nr entries ready in @pool. */
+static int saved_page_pool_fill(struct saved_page_pool *pool, unsigned int nr)
+{
+	struct saved_page *sp;
+
+	for (; pool->nr < nr; pool->nr++) {
+		sp = kmem_cache_alloc(saved_page_cachep, GFP_KERNEL);
+		if (!sp)
+			return -ENOMEM;
+		list_add(&sp->list, &pool->list);
+	}
+	return 0;
+}
+
+/* Make room in the stage and have a saved_page ready for each free slot. */
+static int mmcontext_refill(struct mmcontext_stage *st,
+			    struct saved_page_pool *pool)
+{
+	int ret;
+
+	ret = mmcontext_stage_room(st);
+	if (ret)
+		return ret;
+	return saved_page_pool_fill(pool, MMCONTEXT_BATCH - st->cur->nr);
+}
+
+/* Take an entry from @pool; it is still to be moved onto a list. */
+static struct saved_page *saved_page_take(struct saved_page_pool *pool)
+{
+	pool->nr--;
+	return list_first_entry(&pool->list, struct saved_page, list);
+}
+
+static void saved_page_pool_free(struct saved_page_pool *pool)
+{
+	struct saved_page *sp, *next;
+
+	list_for_each_entry_safe(sp, next, &pool->list, list)
+		kmem_cache_free(saved_page_cachep, sp);
+}
+
+/*
+ * Take the stage out of @mm for the caller to free, once no write fault
+ * can be using it any more: one that found it in mm->stage holds the
+ * mmap_lock for read until it is done with it. mm->saved_context is clear
+ * by now, so no fault after that looks for it.
+ */
+static struct mmcontext_stage *mmcontext_stage_take(struct mm_struct *mm)
+{
+	struct mmcontext_stage *st;
+
+	mmap_write_lock(mm);
+	st = mm->stage;
+	mm->stage = NULL;
+	mmap_write_unlock(mm);
+	return st;
+}
+
+/*
+ * Forget the checkpoint of @mm without restoring it, with the mmap_lock
+ * held for write, or once the address space is gone.
+ */
+static void mmcontext_drop(struct mm_struct *mm)
+{
+	saved_page_free_all(&mm->saved_pages);
+	mmcontext_layout_free(mm->layout);
+	mm->layout = NULL;
+	WRITE_ONCE(mm->saved_context, 0);
+	mmcontext_stage_free(mm->stage);
+	mm->stage = NULL;
+}
+
+#if defined(CONFIG_USERFAULTFD) && defined(CONFIG_HAVE_ARCH_USERFAULTFD_WP)
+#define MMCONTEXT_TRACKING	1
+
+/*
+ * Set or clear the uffd-wp bit across @vma, as uffd_wp_range() does, but
+ * with the TLB flush left to the caller's @tlb. Returns the number of
+ * entries changed.
+ */
+static unsigned long mmcontext_wp_vma(struct mmu_gather *tlb,
+				      struct vm_area_struct *vma, bool enable)
+{
+	unsigned long flags = vma->vm_flags;
+
+	if (enable)
+		flags &= ~VM_WRITE;
+	return change_protection(tlb, vma, vma->vm_start, vma->vm_end,
+				 vm_get_page_prot(flags),
+				 enable ? MM_CP_UFFD_WP : MM_CP_UFFD_WP_RESOLVE);
+}
+
+/* Drop the uffd-wp bits left on pages that were never written. */
+static void mmcontext_unprotect(struct mm_struct *mm)
+{
+	struct vm_area_struct *vma;
+	struct mmu_gather tlb;
+
+	mmap_read_lock(mm);
+	tlb_gather_mmu(&tlb, mm);
+	for (vma = mm->mmap; vma; vma = vma->vm_next)
+		if (mmcontext_vma(vma))
+			mmcontext_wp_vma(&tlb, vma, false);
+	tlb_finish_mmu(&tlb);
+	mmap_read_unlock(mm);
+}
+
+/*
+ * Save the pinned pages mapped by the pte table at @pmd, from @addr up to
+ * @end, until the stage is full, and clear their uffd-wp bit: a write
+ * fault on them has nothing left to save. Returns the address to carry
+ * on from.
+ */
+static unsigned long pinned_save_ptes(struct vm_area_struct *vma, pmd_t *pmd,
+				      unsigned long addr, unsigned long end,
+				      struct saved_page_pool *pool,
+				      unsigned long *nr)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct mmcontext_stage *st = mm->stage;
+	pte_t *pte, *start_pte;
+	struct saved_page *sp;
+	pte_t old, ptent;
+	struct page *page;
+	spinlock_t *ptl;
+	loff_t offset;
+
+	start_pte = pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	for (; addr < end && st->cur->nr < MMCONTEXT_BATCH;
+	     pte++, addr += PAGE_SIZE) {
+		ptent = ptep_get(pte);
+		if (!pte_present(ptent) || !pte_uffd_wp(ptent))
+			continue;
+		page = vm_normal_page(vma, addr, ptent);
+		if (!mmcontext_pinned(page))
+			continue;
+		old = ptep_modify_prot_start(vma, addr, pte);
+		ptep_modify_prot_commit(vma, addr, pte, old,
+					pte_clear_uffd_wp(old));
+
+		offset = mmcontext_layout_offset(mm->layout, vma, addr);
+		if (offset < 0) {
+			sp = saved_page_take(pool);
+			saved_page_key(sp, vma, addr);
+			sp->offset = offset = mm->offset;
+			list_move_tail(&sp->list, &mm->saved_pages);
+			mm->offset += PAGE_SIZE;
+		}
+		copy_highpage(st->cur->pages[st->cur->nr], page);
+		mmcontext_stage_add(st, offset);
+		(*nr)++;
+	}
+	pte_unmap_unlock(start_pte, ptl);
+	return addr;
+}
+
+/*
+ * Save every pinned page of the covered vmas right after they were
+ * write-protected. The copies are taken after the TLB flush and under
+ * the page table lock, so they are as of the checkpoint as far as the
+ * CPUs are concerned; a device may write them at any time anyway. A
+ * pinned THP is split, to be saved through its ptes. Only an mm that
+ * has ever pinned a page is walked.
+ */
+static int mmcontext_save_pinned(struct mm_struct *mm, unsigned long *nr)
+{
+	struct saved_page_pool pool = { .list = LIST_HEAD_INIT(pool.list) };
+	struct mmcontext_stage *st = mm->stage;
+	struct vm_area_struct *vma;
+	unsigned long addr, end;
+	pmd_t *pmd, pmde;
+	int ret = 0;
+
+	if (!test_bit(MMF_HAS_PINNED, &mm->flags))
+		return 0;
+
+	mutex_lock(&st->lock);
+	for (vma = mm->mmap; vma && !ret; vma = vma->vm_next) {
+		if (!mmcontext_vma(vma))
+			continue;
+		for (addr = vma->vm_start; addr < vma->vm_end && !ret;
+		     addr = end) {
+			end = pmd_addr_end(addr, vma->vm_end);
+			pmd = mmcontext_pmd(mm, addr);
+			if (!pmd)
+				continue;
+			pmde = READ_ONCE(*pmd);
+			if (pmd_trans_huge(pmde) &&
+			    mmcontext_pinned(pmd_page(pmde)))
+				split_huge_pmd(vma, pmd, addr);
+			pmd = mm_find_pmd(mm, addr);
+			if (!pmd)
+				continue;
+			while (addr < end) {
+				ret = mmcontext_refill(st, &pool);
+				if (ret)
+					break;
+				addr = pinned_save_ptes(vma, pmd, addr, end,
+							&pool, nr);
+			}
+			cond_resched();
+		}
+	}
+	saved_page_pool_free(&pool);
+	mutex_unlock(&st->lock);
+	return ret;
+}
+
+/*
+ * Take the pages of the pte table at @pmd, from @addr up to @end, that the
+ * checkpoint has not saved yet out of the page table, and hand them over
+ * to it, as many as @pool has entries for: a write-protected page still
+ * holds its contents as of the checkpoint, so the page itself serves as
+ * the saved copy, and the mapping's reference to it becomes the
+ * checkpoint's. Stops at one that is swapped out or migrating, setting
+ * *@fault, for it to be faulted in first. Returns the address to carry
+ * on from.
+ */
+static unsigned long zap_hand_over_ptes(struct vm_area_struct *vma,
+					pmd_t *pmd, unsigned long addr,
+					unsigned long end,
+					struct saved_page_pool *pool,
+					bool *fault)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct mmcontext_stage *st = mm->stage;
+	struct mmu_notifier_range range;
+	unsigned long start = addr;
+	pte_t *pte, *start_pte;
+	struct saved_page *sp;
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t ptent;
+
+	mmu_notifier_range_init(&range, MMU_NOTIFY_CLEAR, 0, vma, mm, addr,
+				end);
+	mmu_notifier_invalidate_range_start(&range);
+	start_pte = pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	for (; addr < end && pool->nr; pte++, addr += PAGE_SIZE) {
+		ptent = ptep_get(pte);
+		if (is_swap_pte(ptent) && pte_swp_uffd_wp(ptent)) {
+			*fault = true;
+			break;
+		}
+		if (!pte_present(ptent) || !pte_uffd_wp(ptent))
+			continue;
+		page = vm_normal_page(vma, addr, ptent);
+		ptep_get_and_clear(mm, addr, pte);
+		if (page) {
+			page_remove_rmap(page, vma, false);
+			dec_mm_counter(mm, MM_ANONPAGES);
+		}
+		sp = saved_page_take(pool);
+		saved_page_key(sp, vma, addr);
+		sp->page = page;
+		list_move_tail(&sp->list, &st->zapped);
+	}
+	pte_unmap_unlock(start_pte, ptl);
+	/* The pages are held, stale read-only entries can wait till here. */
+	if (addr > start)
+		flush_tlb_range(vma, start, addr);
+	mmu_notifier_invalidate_range_end(&range);
+	return addr;
+}
+
+/*
+ * Called with the mmap_lock held before MADV_DONTNEED or MADV_FREE drops
+ * the pages of @vma from @start to @end. Those the checkpoint has not
+ * saved yet would lose their contents with no write fault to save them,
+ * so they are taken over by the checkpoint first, with no copy. A THP is
+ * split, and a swapped out page faulted in, to be taken over through its
+ * pte.
+ */
+int __mmcontext_zap(struct vm_area_struct *vma, unsigned long start,
+		    unsigned long end)
+{
+	struct saved_page_pool pool = { .list = LIST_HEAD_INIT(pool.list) };
+	struct mm_struct *mm = vma->vm_mm;
+	struct mmcontext_stage *st = mm->stage;
+	unsigned long addr, next;
+	pmd_t *pmd, pmde;
+	bool fault;
+	int ret = 0;
+
+	mutex_lock(&st->lock);
+	for (addr = start; addr < end && !ret; addr = next) {
+		next = pmd_addr_end(addr, end);
+		pmd = mmcontext_pmd(mm, addr);
+		if (!pmd)
+			continue;
+		pmde = READ_ONCE(*pmd);
+		if ((pmd_trans_huge(pmde) && pmd_uffd_wp(pmde)) ||
+		    (is_pmd_migration_entry(pmde) && pmd_swp_uffd_wp(pmde)))
+			split_huge_pmd(vma, pmd, addr);
+		pmd = mm_find_pmd(mm, addr);
+		if (!pmd)
+			continue;
+		while (addr < next) {
+			ret = saved_page_pool_fill(&pool, MMCONTEXT_BATCH);
+			if (ret)
+				break;
+			fault = false;
+			addr = zap_hand_over_ptes(vma, pmd, addr, next, &pool,
+						  &fault);
+			if (fault) {
+				ret = fixup_user_fault(mm, addr, 0, NULL);
+				if (ret)
+					break;
+			}
+		}
+		cond_resched();
+	}
+	saved_page_pool_free(&pool);
+	mutex_unlock(&st->lock);
+	return ret;
+}
+
+/*
+ * Write-protect every covered vma with the uffd-wp bit. Swapped out and
+ * migrating pages get the bit in their swap pte, and THPs in their pmd,
+ * so they are caught on their first write too. A THP costs one pmd
+ * update here; its first write splits the pmd, which hands the bit down
+ * to all of its ptes, and only the written page is saved, see
+ * wp_huge_pmd(). Pinned pages are saved right away instead, see
+ * mmcontext_save_pinned().
+ *
+ * All vmas share one mmu_gather, so the TLB is flushed once for the whole
+ * mm on architectures that merge ranges across vmas, and once per vma
+ * elsewhere, rather than once per page.
+ */
+static int mmcontext_protect(struct mm_struct *mm, int flags)
+{
+	struct mmcontext_layout *layout = NULL;
+	unsigned long nr = 0, vma_nr, pinned = 0;
+	struct vm_area_struct *vma;
+	u64 start = ktime_get_ns();
+	struct mmu_gather tlb;
+	int ret;
+
+	ret = mmcontext_stage_alloc(mm);
+	if (ret)
+		return ret;
+
+	mm->offset = 0;
+	mmap_read_lock(mm);
+	ret = mmcontext_anon_prepare(mm);
+	if (!ret && (flags & MMCONTEXT_FIXED_LAYOUT)) {
+		ret = -ENOMEM;
+		layout = mmcontext_layout_alloc(mm, true);
+		if (layout)
+			ret = mmcontext_layout_check(layout) ?:
+			      mmcontext_layout_file(mm->fp, layout);
+	} else if (!ret) {
+		ret = mmcontext_keys_check(mm);
+	}
+	if (ret) {
+		mmap_read_unlock(mm);
+		mmcontext_layout_free(layout);
+		mmcontext_stage_free(mmcontext_stage_take(mm));
+		return ret;
+	}
+	if (layout) {
+		mm->layout = layout;
+		mm->offset = layout->size;
+	}
+	WRITE_ONCE(mm->saved_context, MMCONTEXT_TRACK_WP);
+	tlb_gather_mmu(&tlb, mm);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!mmcontext_vma(vma))
+			continue;
+		vma_nr = mmcontext_wp_vma(&tlb, vma, true);
+		trace_mmcontext_protect_vma(mm, vma->vm_start, vma->vm_end,
+					    vma_nr);
+		nr += vma_nr;
+	}
+	tlb_finish_mmu(&tlb);
+	ret = mmcontext_save_pinned(mm, &pinned);
+	mmap_read_unlock(mm);
+	/*
+	 * Reserve for every page write-protected, as counted by the walk:
+	 * the anonymous page count leaves out zero page ptes, which a write
+	 * saves all the same. The fixed layout stays sparse: its offsets are
+	 * not known yet.
+	 */
+	if (!ret) {
+		if (flags & MMCONTEXT_FIXED_LAYOUT)
+			mmcontext_stat_set(mm, reserved, 0);
+		else
+			ret = mmcontext_reserve(mm, 0, nr);
+	}
+	if (ret) {
+		mmcontext_unprotect(mm);
+		/* Wait out any fault still saving a page. */
+		mmap_write_lock(mm);
+		mmcontext_drop(mm);
+		mmap_write_unlock(mm);
+		return ret;
+	}
+
+	mmcontext_stat_add(mm, checkpoints, 1);
+	mmcontext_stat_set(mm, protected, nr);
+	mmcontext_stat_set(mm, pinned, pinned);
+	mmcontext_count(mm->stage->memcg, CKPT_PROTECT, nr);
+	trace_mmcontext_checkpoint(mm, nr, ktime_get_ns() - start);
+	return 0;
+}
+
+#else
+#define MMCONTEXT_TRACKING	0
+
+static int mmcontext_protect(struct mm_struct *mm, int flags)
+{
+	return -EOPNOTSUPP;
+}
+
+static void mmcontext_unprotect(struct mm_struct *mm)
+{
+}
+
+int __mmcontext_zap(struct vm_area_struct *vma, unsigned long start,
+		    unsigned long end)
+{
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_MEM_SOFT_DIRTY
+struct sd_save {
+	bool all;		/* save clean pages too */
+	struct saved_page_pool pool;
+	unsigned long nr;
+};
+
+/* Copy @page, or zeroes for the zero page, to the stage slot for @sp. */
+static void sd_stage_page(struct mm_struct *mm, struct sd_save *sd,
+			  struct saved_page *sp, struct page *page)
+{
+	struct mmcontext_stage *st = mm->stage;
+
+	if (page)
+		copy_highpage(st->cur->pages[st->cur->nr], page);
+	else
+		clear_highpage(st->cur->pages[st->cur->nr]);
+	sp->offset = mm->offset;
+	mm->offset += PAGE_SIZE;
+	mmcontext_stage_add(st, sp->offset);
+	sd->nr++;
+}
+
+/*
+ * Clear the soft-dirty bit of the present ptes of the table at @pmd from
+ * @addr up to @end, copying the pages to be saved into the stage, until
+ * the stage is full. The copies are taken after the TLB flush and under
+ * the page table lock, so no write can slip in between. Returns the
+ * address to carry on from.
+ */
+static unsigned long sd_save_ptes(struct vm_area_struct *vma, pmd_t *pmd,
+				  unsigned long addr, unsigned long end,
+				  struct sd_save *sd)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct mmcontext_stage *st = mm->stage;
+	unsigned int room = MMCONTEXT_BATCH - st->cur->nr;
+	pgoff_t first = linear_page_index(vma, addr);
+	unsigned long start = addr, vaddr;
+	pte_t *pte, *start_pte;
+	struct saved_page *sp;
+	pte_t old, ptent;
+	struct page *page;
+	spinlock_t *ptl;
+	LIST_HEAD(batch);
+
+	start_pte = pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	for (; addr < end && room; pte++, addr += PAGE_SIZE) {
+		ptent = ptep_get(pte);
+		if (!pte_present(ptent))
+			continue;
+		if (!sd->all && !pte_soft_dirty(ptent) &&
+		    !mmcontext_pinned(vm_normal_page(vma, addr, ptent)))
+			continue;
+		old = ptep_modify_prot_start(vma, addr, pte);
+		ptent = pte_clear_soft_dirty(pte_wrprotect(old));
+		ptep_modify_prot_commit(vma, addr, pte, old, ptent);
+
+		sp = saved_page_take(&sd->pool);
+		saved_page_key(sp, vma, addr);
+		list_move_tail(&sp->list, &batch);
+		room--;
+	}
+	if (!list_empty(&batch))
+		flush_tlb_range(vma, start, addr);
+
+	list_for_each_entry(sp, &batch, list) {
+		pte = start_pte + (sp->pgoff - first);
+		vaddr = start + ((sp->pgoff - first) << PAGE_SHIFT);
+		page = vm_normal_page(vma, vaddr, ptep_get(pte));
+		sd_stage_page(mm, sd, sp, page);
+	}
+	list_splice_tail(&batch, &mm->saved_pages);
+	pte_unmap_unlock(start_pte, ptl);
+	return addr;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Clear the soft-dirty bit of the huge pmd at @pmd and save its pages.
+ * The THP stays mapped by the pmd: a write to any part of it marks the
+ * whole pmd soft-dirty. The mmap_lock is held for write, so once the pmd
+ * is write-protected and flushed no write can change the pages while
+ * they are copied out with the lock dropped. Returns -EAGAIN if the pmd
+ * is no longer huge.
+ */
+static int sd_save_huge(struct vm_area_struct *vma, pmd_t *pmd,
+			unsigned long addr, struct sd_save *sd)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct saved_page *sp;
+	struct page *page;
+	pmd_t old, entry;
+	spinlock_t *ptl;
+	int i, ret = 0;
+
+	ptl = pmd_trans_huge_lock(pmd, vma);
+	if (!ptl)
+		return -EAGAIN;
+	entry = *pmd;
+	if (!pmd_present(entry) ||
+	    (!sd->all && !pmd_soft_dirty(entry) &&
+	     !mmcontext_pinned(pmd_page(entry)))) {
+		spin_unlock(ptl);
+		return 0;
+	}
+	old = pmdp_invalidate(vma, addr, pmd);
+	if (pmd_dirty(old))
+		entry = pmd_mkdirty(entry);
+	if (pmd_young(old))
+		entry = pmd_mkyoung(entry);
+	entry = pmd_clear_soft_dirty(pmd_wrprotect(entry));
+	set_pmd_at(mm, addr, pmd, entry);
+	page = pmd_page(entry);
+	get_page(page);
+	spin_unlock(ptl);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		ret = mmcontext_refill(mm->stage, &sd->pool);
+		if (ret)
+			break;
+		sp = saved_page_take(&sd->pool);
+		saved_page_key(sp, vma, addr + i * PAGE_SIZE);
+		list_move_tail(&sp->list, &mm->saved_pages);
+		sd_stage_page(mm, sd, sp, page + i);
+	}
+	put_page(page);
+	return ret;
+}
+#else
+static int sd_save_huge(struct vm_area_struct *vma, pmd_t *pmd,
+			unsigned long addr, struct sd_save *sd)
+{
+	return -EAGAIN;
+}
+#endif
+
+/*
+ * Copy the pages of the covered vmas to the checkpoint file and clear
+ * their soft-dirty bit, as clear_refs does: all resident pages for a new
+ * checkpoint, only the soft-dirty ones for a save point. A later write
+ * then takes an ordinary write fault that sets the bit again, with
+ * nothing to save. The newest copy of a page is the one at the highest
+ * offset, and restore reads the file in offset order.
+ *
+ * A THP is tracked by its pmd, at 1/512th of the cost of its ptes; a
+ * write to it makes all of it dirty. Pages that are swapped out at
+ * checkpoint time are not part of the checkpoint. Pinned pages are taken
+ * as dirty, by save points and by restore, as a device write leaves no
+ * soft-dirty bit. Called with the mmap_lock held for write.
+ */
+static int mmcontext_sd_save(struct mm_struct *mm, bool first)
+{
+	struct sd_save sd = { .pool.list = LIST_HEAD_INIT(sd.pool.list) };
+	struct mmu_notifier_range range;
+	struct vm_area_struct *vma;
+	u64 start = ktime_get_ns();
+	unsigned long addr, end;
+	pmd_t *pmd;
+	int ret = 0;
+
+	mutex_lock(&mm->stage->lock);
+	mmu_notifier_range_init(&range, MMU_NOTIFY_SOFT_DIRTY, 0, NULL, mm, 0,
+				-1UL);
+	mmu_notifier_invalidate_range_start(&range);
+	for (vma = mm->mmap; vma && !ret; vma = vma->vm_next) {
+		if (!mmcontext_vma(vma))
+			continue;
+		if (anon_vma_prepare(vma)) {
+			ret = -ENOMEM;
+			break;
+		}
+		/* A vma that is soft-dirty as a whole has every page dirty. */
+		sd.all = first || (vma->vm_flags & VM_SOFTDIRTY);
+		if (vma->vm_flags & VM_SOFTDIRTY) {
+			vma->vm_flags &= ~VM_SOFTDIRTY;
+			vma_set_page_prot(vma);
+		}
+		for (addr = vma->vm_start; addr < vma->vm_end && !ret; ) {
+			end = pmd_addr_end(addr, vma->vm_end);
+			pmd = mmcontext_pmd(mm, addr);
+			if (pmd && pmd_trans_huge(*pmd)) {
+				ret = sd_save_huge(vma, pmd, addr, &sd);
+				if (ret != -EAGAIN) {
+					addr = end;
+					continue;
+				}
+				ret = 0;
+			}
+			pmd = mm_find_pmd(mm, addr);
+			if (!pmd) {
+				addr = end;
+				continue;
+			}
+			while (addr < end) {
+				ret = mmcontext_refill(mm->stage, &sd.pool);
+				if (ret)
+					break;
+				addr = sd_save_ptes(vma, pmd, addr, end, &sd);
+			}
+			cond_resched();
+		}
+	}
+	mmu_notifier_invalidate_range_end(&range);
+
+	saved_page_pool_free(&sd.pool);
+	if (!ret) {
+		WRITE_ONCE(mm->saved_context, MMCONTEXT_TRACK_SOFT_DIRTY);
+		mmcontext_stat_add(mm, checkpoints, 1);
+		mmcontext_stat_set(mm, protected, sd.nr);
+		mmcontext_count(mm->stage->memcg, CKPT_PROTECT, sd.nr);
+		trace_mmcontext_checkpoint(mm, sd.nr, ktime_get_ns() - start);
+	}
+	mutex_unlock(&mm->stage->lock);
+	return ret;
+}
+
+/* Start a soft-dirty checkpoint, or take a save point of the active one. */
+static int mmcontext_sd_checkpoint(struct mm_struct *mm)
+{
+	bool first = !mm->saved_context;
+	int ret = 0;
+
+	if (first) {
+		ret = mmcontext_stage_alloc(mm);
+		if (ret)
+			return ret;
+		mm->offset = 0;
+		ret = mmcontext_reserve(mm, 0, mmcontext_anon_pages(mm));
+	} else {
+		mutex_lock(&mm->stage->lock);
+		ret = mmcontext_charge(mm->stage);
+		mutex_unlock(&mm->stage->lock);
+	}
+
+	if (ret)
+		goto out;
+	if (mmap_write_lock_killable(mm)) {
+		ret = -EINTR;
+		goto out;
+	}
+	if (first)
+		ret = mmcontext_keys_check(mm);
+	if (!ret)
+		ret = mmcontext_sd_save(mm, first);
+	/*
+	 * A save that failed part way has cleared the soft-dirty bit of
+	 * pages it did not get to save, which restore would then take as
+	 * clean: there is no consistent point left to go back to.
+	 */
+	if (ret)
+		mmcontext_drop(mm);
+	mmap_write_unlock(mm);
+	return ret;
+
+out:
+	if (first) {
+		mmap_write_lock(mm);
+		mmcontext_drop(mm);
+		mmap_write_unlock(mm);
+	}
+	return ret;
+}
+
+/* Has the page at @addr been written, or gone, since it was saved? */
+static bool sd_page_dirty(struct mm_struct *mm, unsigned long addr)
+{
+	struct vm_area_struct *vma = vma_lookup(mm, addr);
+	bool dirty = true;
+	pmd_t *pmd, pmde;
+	spinlock_t *ptl;
+	pte_t *pte;
+	pte_t entry;
+
+	if (!vma || (vma->vm_flags & VM_SOFTDIRTY))
+		return true;
+	pmd = mmcontext_pmd(mm, addr);
+	if (!pmd)
+		return true;
+	pmde = READ_ONCE(*pmd);
+	if (pmd_trans_huge(pmde))
+		return pmd_soft_dirty(pmde) || mmcontext_pinned(pmd_page(pmde));
+	if (is_pmd_migration_entry(pmde))
+		return pmd_swp_soft_dirty(pmde);
+	if (!pmd_present(pmde))
+		return true;
+	pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	entry = ptep_get(pte);
+	if (pte_present(entry))
+		dirty = pte_soft_dirty(entry) ||
+			mmcontext_pinned(vm_normal_page(vma, addr, entry));
+	else if (is_swap_pte(entry))
+		dirty = pte_swp_soft_dirty(entry);
+	pte_unmap_unlock(pte, ptl);
+	return dirty;
+}
+
+/*
+ * Forget the saved pages on @saved that need no restore, ahead of
+ * restore: those not written since, and those unmapped since, as found
+ * in @map.
+ */
+static void mmcontext_sd_prune(struct mm_struct *mm,
+			       struct mmcontext_layout *map,
+			       struct list_head *saved)
+{
+	struct saved_page *sp, *next;
+	unsigned long addr;
+
+	mmap_read_lock(mm);
+	list_for_each_entry_safe(sp, next, saved, list) {
+		if (mmcontext_vaddr(map, sp->anon_vma, sp->pgoff, &addr) &&
+		    sd_page_dirty(mm, addr))
+			continue;
+		list_del(&sp->list);
+		saved_page_free(sp);
+	}
+	mmap_read_unlock(mm);
+}
+#else
+static int mmcontext_sd_checkpoint(struct mm_struct *mm)
+{
+	return -EOPNOTSUPP;
+}
+
+static void mmcontext_sd_prune(struct mm_struct *mm,
+			       struct mmcontext_layout *map,
+			       struct list_head *saved)
+{
+}
+#endif
+
+/*
+ * Find the longest run on @saved starting at @first, up to MMCONTEXT_BATCH
+ * pages, that is contiguous in the checkpoint file. *@nextp is set to the
+ * first page after the run, or NULL at the end of the list.
+ */
+static unsigned int saved_page_run(struct list_head *saved,
+				   struct saved_page *first,
+				   struct saved_page **nextp)
+{
+	struct saved_page *sp = first, *next = NULL;
+	unsigned int nr = 1;
+
+	while (!list_is_last(&sp->list, saved)) {
+		next = list_next_entry(sp, list);
+		if (nr == MMCONTEXT_BATCH ||
+		    next->offset != sp->offset + PAGE_SIZE)
+			break;
+		sp = next;
+		next = NULL;
+		nr++;
+	}
+	*nextp = next;
+	return nr;
+}
+
+/* Copy @page, or zeroes for the zero page, to the user page at @addr. */
+static int mmcontext_page_to_user(unsigned long addr, struct page *page)
+{
+	void *kaddr;
+	int ret = 0;
+
+	if (!page)
+		return clear_user((void __user *)addr, PAGE_SIZE) ? -EFAULT : 0;
+	kaddr = kmap_local_page(page);
+	if (copy_to_user((void __user *)addr, kaddr, PAGE_SIZE))
+		ret = -EFAULT;
+	kunmap_local(kaddr);
+	return ret;
+}
+
+/* The page index the file offset @pos in region @r is saved from. */
+static pgoff_t region_pgoff(struct mmcontext_region *r, loff_t pos)
+{
+	return r->pgoff + ((pos - r->base) >> PAGE_SHIFT);
+}
+
+/*
+ * Read the data extent from @data to @hole of region @r of the fixed
+ * layout straight into user memory on DAX, in runs that are contiguous in
+ * memory as @map has it now.
+ */
+static int mmcontext_restore_dax(struct mm_struct *mm,
+				 struct mmcontext_layout *map,
+				 struct mmcontext_region *r, loff_t data,
+				 loff_t hole, unsigned long *restored)
+{
+	struct mmcontext_region *m;
+	unsigned long addr;
+	pgoff_t pgoff;
+	loff_t len;
+	int ret;
+
+	for (; data < hole; data += len) {
+		pgoff = region_pgoff(r, data);
+		m = mmcontext_region_find(map, r->anon_vma, pgoff);
+		if (!m) {
+			len = PAGE_SIZE;
+			continue;
+		}
+		len = min_t(loff_t, hole - data,
+			    (loff_t)(m->end - pgoff) << PAGE_SHIFT);
+		addr = m->start + ((pgoff - m->pgoff) << PAGE_SHIFT);
+		ret = mmcontext_user_io(mm->fp, addr, len, data, READ);
+		if (ret)
+			return ret;
+		*restored += len >> PAGE_SHIFT;
+	}
+	return 0;
+}
+
+/*
+ * Copy back the pages saved in @layout: the data extents of each vma's
+ * stretch of the file, as found by SEEK_DATA and SEEK_HOLE, to where @map
+ * has their pages now, through the current batch of @st.
+ */
+static int mmcontext_restore_layout(struct mm_struct *mm,
+				    struct mmcontext_layout *layout,
+				    struct mmcontext_stage *st,
+				    struct mmcontext_layout *map,
+				    unsigned long *restored)
+{
+	struct mmcontext_batch *b = st->cur;
+	struct mmcontext_region *r;
+	loff_t pos, end, data, hole;
+	unsigned int nr, i, j;
+	unsigned long addr;
+	int ret = 0, err;
+	pgoff_t pgoff;
+
+	for (i = 0; i < layout->nr; i++) {
+		r = &layout->regions[i];
+		end = r->base + ((loff_t)(r->end - r->pgoff) << PAGE_SHIFT);
+		for (pos = r->base; pos < end; pos = hole) {
+			data = vfs_llseek(mm->fp, pos, SEEK_DATA);
+			if (data == -ENXIO)
+				break;
+			if (data < 0)
+				return data;
+			if (data >= end)
+				break;
+			hole = vfs_llseek(mm->fp, data, SEEK_HOLE);
+			if (hole < 0)
+				return hole;
+			data = round_down(data, PAGE_SIZE);
+			hole = min(round_up(hole, PAGE_SIZE), end);
+
+			if (mmcontext_dax(mm)) {
+				err = mmcontext_restore_dax(mm, map, r, data,
+							    hole, restored);
+				if (err)
+					return err;
+				continue;
+			}
+
+			for (; data < hole; data += (loff_t)nr << PAGE_SHIFT) {
+				nr = min_t(loff_t, (hole - data) >> PAGE_SHIFT,
+					   MMCONTEXT_BATCH);
+				err = mmcontext_stage_io(mm->fp, b, 0, nr, data,
+							 READ);
+				if (err)
+					return err;
+				pgoff = region_pgoff(r, data);
+				for (j = 0; j < nr; j++) {
+					if (!mmcontext_vaddr(map, r->anon_vma,
+							     pgoff + j, &addr))
+						continue;
+					if (mmcontext_page_to_user(addr,
+								   b->pages[j]))
+						ret = -EFAULT;
+					(*restored)++;
+				}
+			}
+		}
+	}
+	return ret;
+}
+
+/* Copy back the pages taken over by __mmcontext_zap(). */
+static int mmcontext_restore_zapped(struct mmcontext_stage *st,
+				    struct mmcontext_layout *map,
+				    unsigned long *restored)
+{
+	struct saved_page *sp;
+	unsigned long addr;
+	int ret = 0;
+
+	list_for_each_entry(sp, &st->zapped, list) {
+		if (!mmcontext_vaddr(map, sp->anon_vma, sp->pgoff, &addr))
+			continue;
+		if (mmcontext_page_to_user(addr, sp->page))
+			ret = -EFAULT;
+		(*restored)++;
+	}
+	return ret;
+}
+
+/*
+ * Copy every saved page back. Entries are only ever appended to the list
+ * as the file grows, so it is in file offset order already, and the file
+ * is read front to back in large chunks. For a buffered checkpoint file
+ * the readahead for the next chunk is started before the current one is
+ * copied out.
+ *
+ * Each page goes back to the address it is mapped at now, looked up by its
+ * anon_vma and page index in a layout of the vmas taken up front: memory
+ * mremap() moved since the checkpoint is restored where it went, with no
+ * page table walk, and memory unmapped since is skipped.
+ *
+ * The checkpoint is taken out of the mm first, with the mmap_lock held
+ * for write, as mmcontext_stage_take() does: no fault saves a page or
+ * takes the stage lock after that, and the copies to user memory, which
+ * may fault, are done without either lock held.
+ */
+static int mmcontext_restore(struct mm_struct *mm)
+{
+	struct file *fp = mm->fp;
+	bool buffered = !(fp->f_flags & O_DIRECT);
+	u64 start = ktime_get_ns(), delta;
+	unsigned long restored = 0, addr;
+	struct mmcontext_layout *map, *layout;
+	struct saved_page *sp, *next;
+	struct mmcontext_stage *st;
+	struct mem_cgroup *old;
+	LIST_HEAD(saved);
+	unsigned int nr, i;
+	u8 mode;
+	int ret;
+
+	if (mmap_write_lock_killable(mm))
+		return -EINTR;
+	map = mmcontext_layout_alloc(mm, false);
+	if (!map) {
+		mmap_write_unlock(mm);
+		return -ENOMEM;
+	}
+	mode = mm->saved_context;
+	WRITE_ONCE(mm->saved_context, 0);
+	st = mm->stage;
+	mm->stage = NULL;
+	layout = mm->layout;
+	mm->layout = NULL;
+	list_splice_init(&mm->saved_pages, &saved);
+	mmap_write_unlock(mm);
+
+	if (mode == MMCONTEXT_TRACK_SOFT_DIRTY)
+		mmcontext_sd_prune(mm, map, &saved);
+
+	/* The shrinker and compaction leave the stage alone from here on. */
+	mutex_lock(&st->lock);
+	st->restoring = true;
+	ret = mmcontext_flush(st);
+	mutex_unlock(&st->lock);
+
+	old = set_active_memcg(st->memcg);
+	if (ret)
+		goto out;
+	ret = mmcontext_restore_zapped(st, map, &restored);
+	if (ret)
+		goto out;
+
+	if (buffered)
+		vfs_fadvise(fp, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (layout) {
+		ret = mmcontext_restore_layout(mm, layout, st, map, &restored);
+		if (ret)
+			goto out;
+	}
+
+	if (mmcontext_dax(mm)) {
+		list_for_each_entry(sp, &saved, list) {
+			if (!mmcontext_vaddr(map, sp->anon_vma, sp->pgoff,
+					     &addr))
+				continue;
+			ret = mmcontext_user_io(fp, addr, PAGE_SIZE, sp->offset,
+						READ);
+			if (ret)
+				goto out;
+			restored++;
+		}
+		goto out;
+	}
+
+	sp = list_first_entry_or_null(&saved, struct saved_page, list);
+	while (sp) {
+		nr = saved_page_run(&saved, sp, &next);
+		ret = mmcontext_stage_io(fp, st->cur, 0, nr, sp->offset, READ);
+		if (ret)
+			break;
+		if (next && buffered)
+			page_cache_sync_readahead(fp->f_mapping, &fp->f_ra, fp,
+						  next->offset >> PAGE_SHIFT,
+						  MMCONTEXT_BATCH);
+
+		for (i = 0; i < nr; i++, sp = list_next_entry(sp, list)) {
+			if (!mmcontext_vaddr(map, sp->anon_vma, sp->pgoff,
+					     &addr))
+				continue;
+			if (mmcontext_page_to_user(addr, st->cur->pages[i]))
+				ret = -EFAULT;
+			restored++;
+		}
+		sp = next;
+	}
+
+out:
+	saved_page_free_all(&saved);
+	if (layout) {
+		/* Punch out the saved pages, for the next checkpoint too. */
+		vfs_truncate(&fp->f_path, 0);
+		mmcontext_layout_free(layout);
+	}
+	set_active_memcg(old);
+	mmcontext_stat_add(mm, restores, 1);
+	mmcontext_stat_add(mm, restore_pages, restored);
+	delta = ktime_get_ns() - start;
+	mmcontext_stat_add(mm, restore_ns, delta);
+	mmcontext_layout_free(map);
+	if (mode == MMCONTEXT_TRACK_WP)
+		mmcontext_unprotect(mm);
+	mmcontext_count(st->memcg, CKPT_RESTORE_PAGES, restored);
+	trace_mmcontext_restore(mm, restored, delta, ret);
+	mmcontext_stage_free(st);
+	return ret;
+}
+
+struct golden_page {
+	unsigned long addr;
+	struct page *page;
+};
+
+/* A covered vma as it was when the golden image was taken. */
+struct golden_range {
+	unsigned long start;
+	unsigned long end;
+};
+
+/*
+ * A golden image: the anonymous memory of an mm at the time of
+ * sys_mmcontext(MMCONTEXT_GOLDEN), held by page reference and shared by
+ * every mm forked from it afterwards. The pages are mapped read-only and
+ * not PageAnonExclusive, and the extra reference makes do_wp_page() copy
+ * rather than reuse them, so they never change. A page that may be pinned
+ * cannot be shared that way and is held as a private copy instead. A THP
+ * stays whole: its pmd is write-protected, and each of its pages is held
+ * with a reference on the compound page.
+ *
+ * Private copies are movable, see mmcontext_golden_migrate(). A shared
+ * page is not, the reference pins it, so once no mm maps it any more
+ * restore swaps it for a private copy too, see golden_page_adopt(). @lock
+ * protects pages[].page against both; readers take a page reference
+ * under it.
+ *
+ * pages[] is in address order. What lies between them in @ranges, the
+ * covered vmas at the time, was unpopulated or mapped the zero page, and
+ * is zapped on restore to read as zeroes again.
+ */
+struct mmcontext_golden {
+	refcount_t ref;
+	spinlock_t lock;
+	bool dead;		/* being freed, no more moves */
+	struct mem_cgroup *memcg;	/* of the copies */
+	struct golden_range *ranges;
+	unsigned long nr_ranges;
+	unsigned long nr;
+	struct golden_page pages[];
+};
+
+struct golden_walk {
+	struct mmcontext_golden *golden;
+	unsigned long max;
+};
+
+static int golden_count_pte(struct vm_area_struct *vma, unsigned long addr,
+			    pte_t *pte, void *priv)
+{
+	(*(unsigned long *)priv)++;
+	return 0;
+}
+
+static int golden_count_pmd(struct vm_area_struct *vma, unsigned long addr,
+			    pmd_t *pmd, void *priv)
+{
+	if (!is_huge_zero_pmd(*pmd))
+		*(unsigned long *)priv += HPAGE_PMD_NR;
+	return 0;
+}
+
+static int golden_take_pte(struct vm_area_struct *vma, unsigned long addr,
+			   pte_t *pte, void *priv)
+{
+	struct golden_walk *gw = priv;
+	struct mmcontext_golden *golden = gw->golden;
+	struct mm_struct *mm = vma->vm_mm;
+	struct page *page, *copy;
+	pte_t entry;
+
+	/*
+	 * Cannot happen with the mmap_lock held for write since the count,
+	 * but a page left out would be zapped on restore.
+	 */
+	if (golden->nr == gw->max)
+		return -EAGAIN;
+	page = vm_normal_page(vma, addr, *pte);
+	if (!page || !PageAnon(page))
+		return 0;
+
+	if (PageAnonExclusive(page)) {
+		entry = ptep_clear_flush(vma, addr, pte);
+		if (page_try_share_anon_rmap(page)) {
+			set_pte_at(mm, addr, pte, entry);
+			copy = alloc_page(GFP_NOWAIT | __GFP_NOWARN |
+					  __GFP_ACCOUNT | __GFP_HIGHMEM |
+					  __GFP_MOVABLE);
+			if (!copy)
+				return -ENOMEM;
+			copy_highpage(copy, page);
+			page = copy;
+			goto out;
+		}
+		set_pte_at(mm, addr, pte, pte_wrprotect(entry));
+	} else if (pte_write(*pte)) {
+		ptep_set_wrprotect(mm, addr, pte);
+		flush_tlb_page(vma, addr);
+	}
+	get_page(page);
+out:
+	golden->pages[golden->nr].addr = addr;
+	golden->pages[golden->nr].page = page;
+	golden->nr++;
+	return 0;
+}
+
+/*
+ * Share a THP with the golden image whole, rather than split it for good.
+ * One that may be pinned is split instead, for its pages to be copied.
+ */
+static int golden_take_pmd(struct vm_area_struct *vma, unsigned long addr,
+			   pmd_t *pmd, void *priv)
+{
+	struct golden_walk *gw = priv;
+	struct mmcontext_golden *golden = gw->golden;
+	struct mm_struct *mm = vma->vm_mm;
+	struct page *page;
+	pmd_t entry;
+	int i;
+
+	if (is_huge_zero_pmd(*pmd))
+		return 0;
+	if (golden->nr + HPAGE_PMD_NR > gw->max)
+		return -EAGAIN;
+	page = pmd_page(*pmd);
+	if (!PageAnon(page))
+		return 0;
+
+	if (PageAnonExclusive(page)) {
+		entry = pmdp_huge_clear_flush(vma, addr, pmd);
+		if (page_try_share_anon_rmap(page)) {
+			set_pmd_at(mm, addr, pmd, entry);
+			return 1;
+		}
+		set_pmd_at(mm, addr, pmd, pmd_wrprotect(entry));
+	} else if (pmd_write(*pmd)) {
+		pmdp_set_wrprotect(mm, addr, pmd);
+		flush_pmd_tlb_range(vma, addr, addr + HPAGE_PMD_SIZE);
+	}
+	page_ref_add(page, HPAGE_PMD_NR);
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		golden->pages[golden->nr].addr = addr + i * PAGE_SIZE;
+		golden->pages[golden->nr].page = page + i;
+		golden->nr++;
+	}
+	return 0;
+}
+
+/*
+ * Move a private copy held by a golden image. Readers may still be copying
+ * from @src, but hold a reference to it.
+ */
+static int mmcontext_golden_migrate(struct page *dst, struct page *src,
+				    enum migrate_mode mode)
+{
+	struct mmcontext_golden *golden;
+	int ret;
+
+	if (mode == MIGRATE_SYNC_NO_COPY)
+		return -EINVAL;
+	golden = (struct mmcontext_golden *)page_private(src);
+	copy_highpage(dst, src);
+	spin_lock(&golden->lock);
+	ret = golden->dead ? -EAGAIN :
+	      mmcontext_page_charge(dst, src, golden->memcg);
+	if (ret) {
+		spin_unlock(&golden->lock);
+		return ret;
+	}
+	WRITE_ONCE(golden->pages[src->index].page, dst);
+	spin_unlock(&golden->lock);
+	mmcontext_page_replace(dst, src);
+	return MIGRATEPAGE_SUCCESS;
+}
+
+static const struct movable_operations mmcontext_golden_mops = {
+	.isolate_page = mmcontext_page_isolate,
+	.migrate_page = mmcontext_golden_migrate,
+	.putback_page = mmcontext_page_putback,
+};
+
+static void mmcontext_golden_put(struct mmcontext_golden *golden)
+{
+	struct page *page;
+	unsigned long i;
+
+	if (!refcount_dec_and_test(&golden->ref))
+		return;
+	spin_lock(&golden->lock);
+	golden->dead = true;
+	spin_unlock(&golden->lock);
+	for (i = 0; i < golden->nr; i++) {
+		page = golden->pages[i].page;
+		if (PageAnon(page))
+			put_page(page);
+		else
+			mmcontext_page_free(page);
+	}
+	mem_cgroup_put(golden->memcg);
+	kvfree(golden->ranges);
+	kvfree(golden);
+}
+
+/* The page held for @gp, with a reference to it. */
+static struct page *golden_page_get(struct mmcontext_golden *golden,
+				    struct golden_page *gp)
+{
+	struct page *page;
+
+	spin_lock(&golden->lock);
+	page = gp->page;
+	get_page(page);
+	spin_unlock(&golden->lock);
+	return page;
+}
+
+/*
+ * Swap @page, held for golden->pages[@i], for a movable private copy if no
+ * mm maps it any more, as only the golden image keeps it from being freed
+ * or moved then.
+ */
+static void golden_page_adopt(struct mmcontext_golden *golden,
+			      unsigned long i, struct page *page)
+{
+	struct golden_page *gp = &golden->pages[i];
+	struct mem_cgroup *old;
+	struct page *copy;
+
+	if (!PageAnon(page) || page_mapped(page))
+		return;
+	old = set_active_memcg(golden->memcg);
+	copy = alloc_page(GFP_HIGHUSER_MOVABLE | __GFP_NOWARN | __GFP_ACCOUNT);
+	set_active_memcg(old);
+	if (!copy)
+		return;
+	copy_highpage(copy, page);
+
+	spin_lock(&golden->lock);
+	if (gp->page != page) {
+		/* Another restore got there first. */
+		spin_unlock(&golden->lock);
+		put_page(copy);
+		return;
+	}
+	WRITE_ONCE(gp->page, copy);
+	spin_unlock(&golden->lock);
+	mmcontext_page_own(copy, &mmcontext_golden_mops, golden, i);
+	put_page(page);
+}
+
+/* Note down the covered vmas of @mm in @golden. */
+static int golden_ranges(struct mm_struct *mm, struct mmcontext_golden *golden)
+{
+	struct vm_area_struct *vma;
+	struct golden_range *r;
+	unsigned long nr = 0;
+
+	for (vma = mm->mmap; vma; vma = vma->vm_next)
+		if (mmcontext_vma(vma))
+			nr++;
+	golden->ranges = kvmalloc_array(nr, sizeof(*r), GFP_KERNEL_ACCOUNT);
+	if (!golden->ranges)
+		return -ENOMEM;
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!mmcontext_vma(vma))
+			continue;
+		r = &golden->ranges[golden->nr_ranges++];
+		r->start = vma->vm_start;
+		r->end = vma->vm_end;
+	}
+	return 0;
+}
+
+static int mmcontext_golden_take(struct mm_struct *mm)
+{
+	struct golden_walk gw = {};
+	unsigned long nr = 0, i;
+	struct page *page;
+	int ret;
+
+	if (mmap_write_lock_killable(mm))
+		return -EINTR;
+	if (mm->golden) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = mmcontext_walk(mm, golden_count_pte, golden_count_pmd, &nr);
+	if (ret)
+		goto out;
+	gw.golden = kvmalloc(struct_size(gw.golden, pages, nr),
+			     GFP_KERNEL_ACCOUNT);
+	if (!gw.golden) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	refcount_set(&gw.golden->ref, 1);
+	spin_lock_init(&gw.golden->lock);
+	gw.golden->dead = false;
+	gw.golden->memcg = get_mem_cgroup_from_mm(mm);
+	gw.golden->ranges = NULL;
+	gw.golden->nr_ranges = 0;
+	gw.golden->nr = 0;
+	gw.max = nr;
+
+	ret = golden_ranges(mm, gw.golden);
+	if (!ret)
+		ret = mmcontext_walk(mm, golden_take_pte, golden_take_pmd,
+				     &gw);
+	if (ret) {
+		mmcontext_golden_put(gw.golden);
+		goto out;
+	}
+	/* The copies were taken under the page table lock. */
+	for (i = 0; i < gw.golden->nr; i++) {
+		page = gw.golden->pages[i].page;
+		if (!PageAnon(page))
+			mmcontext_page_own(page, &mmcontext_golden_mops,
+					   gw.golden, i);
+	}
+	mm->golden = gw.golden;
+out:
+	mmap_write_unlock(mm);
+	return ret;
+}
+
+static int mmcontext_golden_drop(struct mm_struct *mm)
+{
+	struct mmcontext_golden *golden;
+
+	mmap_write_lock(mm);
+	golden = mm->golden;
+	mm->golden = NULL;
+	mmap_write_unlock(mm);
+
+	if (!golden)
+		return -EINVAL;
+	mmcontext_golden_put(golden);
+	return 0;
+}
+
+/* Is @gp still mapped, unmodified, at its address? */
+static bool golden_page_mapped(struct mm_struct *mm, struct golden_page *gp)
+{
+	unsigned long pfn = page_to_pfn(READ_ONCE(gp->page));
+	pmd_t *pmd, pmde;
+	pte_t *pte;
+	pte_t entry;
+
+	pmd = mmcontext_pmd(mm, gp->addr);
+	if (!pmd)
+		return false;
+	pmde = READ_ONCE(*pmd);
+	if (pmd_trans_huge(pmde))
+		return pmd_pfn(pmde) + pte_index(gp->addr) == pfn;
+	if (!pmd_present(pmde))
+		return false;
+	pte = pte_offset_map(pmd, gp->addr);
+	entry = ptep_get(pte);
+	pte_unmap(pte);
+	return pte_present(entry) && pte_pfn(entry) == pfn;
+}
+
+/* Zap @start to @end in the covered vmas of @mm. */
+static void golden_zap(struct mm_struct *mm, unsigned long start,
+		       unsigned long end)
+{
+	struct vm_area_struct *vma;
+	unsigned long from, to;
+
+	for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+	     vma = vma->vm_next) {
+		if (!mmcontext_vma(vma))
+			continue;
+		from = max(start, vma->vm_start);
+		to = min(end, vma->vm_end);
+		/* A checkpoint taken since takes the pages over first. */
+		if (mmcontext_zap(vma, from, to))
+			continue;
+		zap_page_range_single(vma, from, to - from, NULL);
+	}
+}
+
+/*
+ * Zap what the golden image holds no page for in the vmas it was taken
+ * of, the ranges that were unpopulated or mapped the zero page then, so
+ * that they read as zeroes again.
+ */
+static void golden_zap_holes(struct mm_struct *mm,
+			     struct mmcontext_golden *golden)
+{
+	struct golden_range *r;
+	unsigned long i, j = 0, addr, end;
+
+	mmap_read_lock(mm);
+	for (i = 0; i < golden->nr_ranges; i++) {
+		r = &golden->ranges[i];
+		for (addr = r->start; addr < r->end; addr = end + PAGE_SIZE) {
+			while (j < golden->nr && golden->pages[j].addr < addr)
+				j++;
+			end = r->end;
+			if (j < golden->nr)
+				end = min(end, golden->pages[j].addr);
+			if (end > addr)
+				golden_zap(mm, addr, end);
+			cond_resched();
+		}
+	}
+	mmap_read_unlock(mm);
+}
+
+/*
+ * Put back every page that no longer maps its golden page. Those still
+ * mapping it are shared with the golden image and need nothing; the rest
+ * are copied back from the golden pages, with no file I/O involved. What
+ * was not populated at the time is zapped. Like golden_zap(), this only
+ * touches what is still covered memory: whatever was mapped over a golden
+ * page's address since is left alone.
+ */
+static int mmcontext_golden_restore(struct mm_struct *mm)
+{
+	struct golden_page *stale[MMCONTEXT_BATCH], *gp;
+	struct mmcontext_golden *golden;
+	struct vm_area_struct *vma;
+	unsigned long i = 0, restored = 0;
+	u64 start = ktime_get_ns(), delta;
+	unsigned int nr, j;
+	struct page *page;
+	void *kaddr;
+	int ret = 0;
+
+	mmap_read_lock(mm);
+	golden = mm->golden;
+	if (golden)
+		refcount_inc(&golden->ref);
+	mmap_read_unlock(mm);
+	if (!golden)
+		return -EINVAL;
+
+	golden_zap_holes(mm, golden);
+	while (i < golden->nr) {
+		nr = 0;
+		mmap_read_lock(mm);
+		for (; i < golden->nr && nr < MMCONTEXT_BATCH; i++) {
+			gp = &golden->pages[i];
+			vma = vma_lookup(mm, gp->addr);
+			if (vma && mmcontext_vma(vma) &&
+			    !golden_page_mapped(mm, gp))
+				stale[nr++] = gp;
+		}
+		mmap_read_unlock(mm);
+
+		for (j = 0; j < nr; j++) {
+			page = golden_page_get(golden, stale[j]);
+			kaddr = kmap_local_page(page);
+			if (copy_to_user((void __user *)stale[j]->addr, kaddr,
+					 PAGE_SIZE))
+				ret = -EFAULT;
+			kunmap_local(kaddr);
+			golden_page_adopt(golden, stale[j] - golden->pages,
+					  page);
+			put_page(page);
+		}
+		restored += nr;
+	}
+
+	delta = ktime_get_ns() - start;
+	mmcontext_stat_add(mm, restores, 1);
+	mmcontext_stat_add(mm, restore_pages, restored);
+	mmcontext_stat_add(mm, restore_ns, delta);
+	mmcontext_count(golden->memcg, CKPT_RESTORE_PAGES, restored);
+	trace_mmcontext_restore(mm, restored, delta, ret);
+	mmcontext_golden_put(golden);
+	return ret;
+}
+
+/* Called from dup_mmap(): a child shares its parent's golden image. */
+void mmcontext_dup_mmap(struct mm_struct *oldmm, struct mm_struct *mm)
+{
+	if (oldmm->golden) {
+		refcount_inc(&oldmm->golden->ref);
+		mm->golden = oldmm->golden;
+	}
+}
+
+/*
+ * Free the checkpoint state of @mm, whose address space is gone: the
+ * saved page index and stage, its reference to the golden image, and the
+ * checkpoint file, which has no name, so the last fput() frees it.
+ */
+static void mmcontext_release_mm(struct mm_struct *mm)
+{
+	if (mm->stage)
+		mmcontext_drop(mm);
+	if (mm->golden) {
+		mmcontext_golden_put(mm->golden);
+		mm->golden = NULL;
+	}
+	if (mm->fp) {
+		fput(mm->fp);
+		mm->fp = NULL;
+	}
+}
+
+struct mmcontext_release {
+	struct work_struct work;
+	struct mm_struct *mm;
+};
+
+static void mmcontext_release_fn(struct work_struct *work)
+{
+	struct mmcontext_release *rel =
+		container_of(work, struct mmcontext_release, work);
+
+	mmcontext_release_mm(rel->mm);
+	mmdrop(rel->mm);
+	kfree(rel);
+}
+
+/*
+ * Called from __mmput() once the address space is gone, once per mm
+ * however many threads shared it, on exit and on exec() alike. Freeing
+ * a large saved page index and stage, and evicting the checkpoint file,
+ * can take hundreds of milliseconds, so it is left to a workqueue, holding
+ * on to the mm_struct, rather than holding up exit and the parent's
+ * wait(), or exec(). The shrinker may still free held batches meanwhile,
+ * but no longer writes them, see mmcontext_spill().
+ */
+void mmcontext_exit_mm(struct mm_struct *mm)
+{
+	struct mmcontext_release *rel;
+
+	if (!mm->stage && !mm->fp && !mm->golden)
+		return;
+
+	rel = kmalloc(sizeof(*rel), GFP_KERNEL);
+	if (!rel) {
+		mmcontext_release_mm(mm);
+		return;
+	}
+	mmgrab(mm);
+	rel->mm = mm;
+	INIT_WORK(&rel->work, mmcontext_release_fn);
+	queue_work(system_unbound_wq, &rel->work);
+}
+
+/*
+ * The checkpoint file is an O_TMPFILE: it never has a name for anyone to
+ * find, plant a link at or inherit across exec(), and nothing is left to
+ * unlink on exit. Prefer O_DIRECT; fall back to buffered I/O on
+ * filesystems that do not support it.
+ */
+static struct file *mmcontext_open(void)
+{
+	const char *dir = mmcontext_dir[0] ? mmcontext_dir : "/";
+	struct file *fp;
+
+	fp = filp_open(dir, O_TMPFILE | O_RDWR | O_DIRECT, 0600);
+	if (PTR_ERR_OR_ZERO(fp) == -EINVAL)
+		fp = filp_open(dir, O_TMPFILE | O_RDWR, 0600);
+	return fp;
+}
+
+/* The checkpoint file is opened on first use and kept until exit. */
+static int mmcontext_get_file(struct mm_struct *mm)
+{
+	struct file *fp;
+
+	if (mm->fp)
+		return 0;
+	fp = mmcontext_open();
+	if (IS_ERR(fp))
+		return PTR_ERR(fp);
+	mm->fp = fp;
+	return 0;
+}
+
+static int __init mmcontext_init(void)
+{
+	int ret;
+
+	saved_page_cachep = KMEM_CACHE(saved_page, SLAB_ACCOUNT | SLAB_PANIC);
+	ret = prealloc_shrinker(&mmcontext_shrinker, "mmcontext-stage");
+	if (ret)
+		return ret;
+	ret = list_lru_init_memcg(&mmcontext_held_lru, &mmcontext_shrinker);
+	if (ret) {
+		free_prealloced_shrinker(&mmcontext_shrinker);
+		return ret;
+	}
+	register_shrinker_prepared(&mmcontext_shrinker);
+	return 0;
+}
+subsys_initcall(mmcontext_init);
+
+/*
+ * Run @op with @flags on @mm, under mm->mmcontext_lock: threads of one
+ * process may call sys_mmcontext() at once, and mm->saved_context, stage,
+ * layout and fp only change in here.
+ */
+static int mmcontext_op(struct mm_struct *mm, int op, int flags)
+{
+	int ret;
+
+	switch (op) {
+	case MMCONTEXT_CHECKPOINT:
+		if (!MMCONTEXT_TRACKING)
+			return -EOPNOTSUPP;
+		if (mm->saved_context)
+			return -EINVAL;
+		ret = mmcontext_get_file(mm);
+		if (ret)
+			return ret;
+		return mmcontext_protect(mm, flags);
+	case MMCONTEXT_CHECKPOINT_SOFT_DIRTY:
+		if (!IS_ENABLED(CONFIG_MEM_SOFT_DIRTY))
+			return -EOPNOTSUPP;
+		if (mm->saved_context == MMCONTEXT_TRACK_WP)
+			return -EINVAL;
+		ret = mmcontext_get_file(mm);
+		if (ret)
+			return ret;
+		return mmcontext_sd_checkpoint(mm);
+	case MMCONTEXT_RESTORE:
+		if (mm->saved_context)
+			return mmcontext_restore(mm);
+		return mmcontext_golden_restore(mm);
+	case MMCONTEXT_GOLDEN:
+		return mmcontext_golden_take(mm);
+	case MMCONTEXT_GOLDEN_DROP:
+		return mmcontext_golden_drop(mm);
+	}
+	return -EINVAL;
+}
+
+SYSCALL_DEFINE1(mmcontext, int, x)
+{
+	struct mm_struct *mm = current->mm;
+	int op = x & MMCONTEXT_OP_MASK;
+	int flags = x & ~MMCONTEXT_OP_MASK;
+	int ret;
+
+	if (flags & ~MMCONTEXT_FIXED_LAYOUT)
+		return -EINVAL;
+	if (flags && op != MMCONTEXT_CHECKPOINT)
+		return -EINVAL;
+
+	if (mutex_lock_killable(&mm->mmcontext_lock))
+		return -EINTR;
+	ret = mmcontext_op(mm, op, flags);
+	mutex_unlock(&mm->mmcontext_lock);
+	return ret;
+}
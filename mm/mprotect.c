@@ -28,6 +28,7 @@
 #include <linux/ksm.h>
 #include <linux/uaccess.h>
 #include <linux/mm_inline.h>
+#include <linux/mmcontext.h>
 #include <linux/pgtable.h>
 #include <linux/sched/sysctl.h>
 #include <linux/userfaultfd_k.h>
@@ -56,6 +57,10 @@ static inline bool can_change_pte_writable(struct vm_area_struct *vma,
 	if (userfaultfd_pte_wp(vma, pte))
 		return false;
 
+	/* Or for a checkpoint that has not saved this page yet? */
+	if (mmcontext_pte_wp(vma, pte))
+		return false;
+
 	if (!(vma->vm_flags & VM_SHARED)) {
 		/*
 		 * We can only special-case on exclusive anonymous pages,
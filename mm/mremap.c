@@ -13,6 +13,7 @@
 #include <linux/shm.h>
 #include <linux/ksm.h>
 #include <linux/mman.h>
+#include <linux/mmcontext.h>
 #include <linux/swap.h>
 #include <linux/capability.h>
 #include <linux/fs.h>
@@ -750,6 +751,14 @@ static struct vm_area_struct *vma_to_resize(unsigned long addr,
 			(vma->vm_flags & (VM_DONTEXPAND | VM_PFNMAP)))
 		return ERR_PTR(-EINVAL);
 
+	/*
+	 * A partial MREMAP_DONTUNMAP leaves the old vma with the anon_vma
+	 * and page indexes of the new one, which a checkpoint keys its
+	 * saved pages by.
+	 */
+	if ((flags & MREMAP_DONTUNMAP) && mmcontext_vma_active(vma))
+		return ERR_PTR(-EBUSY);
+
 	/* We can't remap across vm area boundaries */
 	if (old_len > vma->vm_end - addr)
 		return ERR_PTR(-EFAULT);
@@ -1407,6 +1407,11 @@ const char * const vmstat_text[] = {
 	"zswpin",
 	"zswpout",
 #endif
+#ifdef CONFIG_MMU
+	"ckpt_protect",
+	"ckpt_cow_save",
+	"ckpt_restore_pages",
+#endif
 #ifdef CONFIG_X86
 	"direct_map_level2_splits",
 	"direct_map_level3_splits",
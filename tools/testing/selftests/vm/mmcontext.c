@@ -0,0 +1,1000 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Tests and benchmarks for anonymous memory checkpoint/restore
+ * (sys_mmcontext).
+ *
+ * Without arguments the correctness tests are run. With -b the
+ * benchmarks are run as well: checkpoint time against RSS, the latency
+ * of the first write to each page after a checkpoint, restore throughput
+ * and the memory used while a checkpoint is active.
+ *
+ * The checkpoint file is an unnamed O_TMPFILE in mmcontext.dir=, / by
+ * default, so this has to run as root.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "../kselftest.h"
+
+#ifndef __NR_mmcontext
+#define __NR_mmcontext		451
+#endif
+
+#define MMCONTEXT_CHECKPOINT	0
+#define MMCONTEXT_RESTORE	1
+#define MMCONTEXT_GOLDEN	2
+#define MMCONTEXT_GOLDEN_DROP	3
+#define MMCONTEXT_CHECKPOINT_SOFT_DIRTY	4
+#define MMCONTEXT_FIXED_LAYOUT	0x100
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT		21
+#endif
+
+#define KHUGEPAGED	"/sys/kernel/mm/transparent_hugepage/khugepaged/"
+#define CGROUP_TEST	"/sys/fs/cgroup/mmcontext_test"
+
+#define SIZE_MB(x)		((size_t)(x) << 20)
+#define NR_THREADS		8
+#define NR_HIST			32
+
+static size_t pagesize;
+
+static long mmcontext(int op)
+{
+	return syscall(__NR_mmcontext, op);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *map_anon(size_t size)
+{
+	char *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		ksft_exit_fail_msg("mmap failed: %s\n", strerror(errno));
+	return p;
+}
+
+/* Give every page its own byte so misplaced pages are caught too. */
+static void fill(char *p, size_t size, unsigned char seed)
+{
+	size_t off;
+
+	for (off = 0; off < size; off += pagesize)
+		memset(p + off, (unsigned char)(seed + off / pagesize),
+		       pagesize);
+}
+
+static bool check(const char *p, size_t size, unsigned char seed)
+{
+	size_t off, i;
+
+	for (off = 0; off < size; off += pagesize) {
+		unsigned char c = seed + off / pagesize;
+
+		for (i = 0; i < pagesize; i++) {
+			if ((unsigned char)p[off + i] != c) {
+				ksft_print_msg("mismatch at offset %zu: %#x != %#x\n",
+					       off + i, (unsigned char)p[off + i], c);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool zeroes(const char *p, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (p[i]) {
+			ksft_print_msg("non-zero byte at offset %zu: %#x\n", i,
+				       (unsigned char)p[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void report(bool ok, const char *name)
+{
+	if (ok)
+		ksft_test_result_pass("%s\n", name);
+	else
+		ksft_test_result_fail("%s\n", name);
+}
+
+static bool checkpoint(void)
+{
+	if (mmcontext(MMCONTEXT_CHECKPOINT)) {
+		ksft_print_msg("checkpoint failed: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static bool restore(void)
+{
+	if (mmcontext(MMCONTEXT_RESTORE)) {
+		ksft_print_msg("restore failed: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void test_single(void)
+{
+	size_t size = SIZE_MB(4);
+	char *p = map_anon(size);
+	bool ok;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	fill(p, size, 2);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "single threaded restore");
+	munmap(p, size);
+}
+
+static void test_partial(void)
+{
+	size_t size = SIZE_MB(4);
+	char *p = map_anon(size);
+	size_t off;
+	bool ok;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	/* Dirty every third page only, twice, in reverse order. */
+	for (off = size; off >= 3 * pagesize; off -= 3 * pagesize) {
+		p[off - pagesize] = 0x55;
+		p[off - pagesize + 1] = 0xaa;
+	}
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "partial write restore");
+	munmap(p, size);
+}
+
+/* Sparse file layout; a mapping made after the checkpoint is left alone. */
+static void test_fixed_layout(void)
+{
+	size_t size = SIZE_MB(4), off;
+	char *p = map_anon(size), *q;
+	bool ok;
+
+	fill(p, size, 1);
+	if (mmcontext(MMCONTEXT_CHECKPOINT | MMCONTEXT_FIXED_LAYOUT)) {
+		if (errno == EOPNOTSUPP)
+			ksft_test_result_skip("fixed layout restore: not supported\n");
+		else
+			report(false, "fixed layout restore");
+		munmap(p, size);
+		return;
+	}
+	q = map_anon(size);
+	fill(q, size, 4);
+	for (off = size; off >= 3 * pagesize; off -= 3 * pagesize)
+		p[off - pagesize] = 0x55;
+	ok = restore();
+	report(ok && check(p, size, 1) && check(q, size, 4),
+	       "fixed layout restore");
+	munmap(q, size);
+	munmap(p, size);
+}
+
+struct thread_arg {
+	char *p;
+	size_t size;
+};
+
+static void *writer(void *data)
+{
+	struct thread_arg *arg = data;
+
+	fill(arg->p, arg->size, 2);
+	return NULL;
+}
+
+static void test_threads(void)
+{
+	size_t size = SIZE_MB(16), chunk = size / NR_THREADS;
+	struct thread_arg args[NR_THREADS];
+	pthread_t threads[NR_THREADS];
+	char *p = map_anon(size);
+	bool ok;
+	int i;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	for (i = 0; i < NR_THREADS; i++) {
+		args[i].p = p + i * chunk;
+		args[i].size = chunk;
+		pthread_create(&threads[i], NULL, writer, &args[i]);
+	}
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "multi threaded restore");
+	munmap(p, size);
+}
+
+/* Write one page of the first THP only; the second must be left alone. */
+static void test_thp(int op, const char *name)
+{
+	size_t hpage = SIZE_MB(2), size = 2 * hpage;
+	char *map = map_anon(size + hpage);
+	char *p = (char *)(((uintptr_t)map + hpage - 1) & ~(hpage - 1));
+	bool ok;
+
+	if (madvise(p, size, MADV_HUGEPAGE)) {
+		ksft_test_result_skip("%s: MADV_HUGEPAGE: %s\n", name,
+				      strerror(errno));
+		munmap(map, size + hpage);
+		return;
+	}
+	fill(p, size, 1);
+	if (mmcontext(op)) {
+		if (errno == EOPNOTSUPP)
+			ksft_test_result_skip("%s: not supported\n", name);
+		else
+			report(false, name);
+		munmap(map, size + hpage);
+		return;
+	}
+	memset(p + 3 * pagesize, 0x55, pagesize);
+	ok = restore();
+	report(ok && check(p, size, 1), name);
+	munmap(map, size + hpage);
+}
+
+static void test_swap(void)
+{
+	size_t size = SIZE_MB(4);
+	char *p = map_anon(size);
+	bool ok;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	if (madvise(p, size, MADV_PAGEOUT)) {
+		ksft_test_result_skip("swapped out restore: MADV_PAGEOUT: %s\n",
+				      strerror(errno));
+		restore();
+		munmap(p, size);
+		return;
+	}
+	fill(p, size, 2);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "swapped out restore");
+	munmap(p, size);
+}
+
+/*
+ * Soft-dirty mode: the second checkpoint is a save point, so restore goes
+ * back to the contents at that point rather than at the first one.
+ */
+static void test_soft_dirty(void)
+{
+	size_t size = SIZE_MB(4), half = size / 2;
+	char *p = map_anon(size);
+	bool ok;
+
+	fill(p, size, 1);
+	if (mmcontext(MMCONTEXT_CHECKPOINT_SOFT_DIRTY)) {
+		if (errno == EOPNOTSUPP)
+			ksft_test_result_skip("soft-dirty save point restore: not supported\n");
+		else
+			report(false, "soft-dirty save point restore");
+		munmap(p, size);
+		return;
+	}
+	/* Only the first half changes before the save point. */
+	fill(p, half, 2);
+	ok = !mmcontext(MMCONTEXT_CHECKPOINT_SOFT_DIRTY);
+	fill(p, size, 3);
+	ok = restore() && ok;
+	report(ok && check(p, half, 2) &&
+	       check(p + half, half, 1 + half / pagesize),
+	       "soft-dirty save point restore");
+	munmap(p, size);
+}
+
+/*
+ * Pages dropped with MADV_DONTNEED or MADV_FREE before they were written
+ * still come back on restore.
+ */
+static void test_dontneed(void)
+{
+	size_t size = SIZE_MB(4), half = size / 2;
+	char *p = map_anon(size);
+	bool ok;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	ok = ok && !madvise(p, half, MADV_DONTNEED);
+	ok = ok && !madvise(p + half, half, MADV_FREE);
+	fill(p, size, 2);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "restore after MADV_DONTNEED/FREE");
+	munmap(p, size);
+}
+
+/*
+ * Memory mremap() moves after the checkpoint is restored at its new
+ * address: half of it is written before the move, half after.
+ */
+static void test_mremap(int flags, const char *name)
+{
+	size_t size = SIZE_MB(4), half = size / 2;
+	char *p = map_anon(size), *q = map_anon(size);
+	bool ok;
+
+	fill(p, size, 1);
+	if (mmcontext(MMCONTEXT_CHECKPOINT | flags)) {
+		if (errno == EOPNOTSUPP)
+			ksft_test_result_skip("%s: not supported\n", name);
+		else
+			report(false, name);
+		munmap(q, size);
+		munmap(p, size);
+		return;
+	}
+	fill(p, half, 2);
+	if (mremap(p, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, q) != q)
+		ksft_exit_fail_msg("mremap failed: %s\n", strerror(errno));
+	fill(q + half, half, 2);
+	ok = restore();
+	report(ok && check(q, size, 1), name);
+	munmap(q, size);
+}
+
+/* The pages must stay tracked when mprotect() makes them writable again. */
+static void test_mprotect(void)
+{
+	size_t size = SIZE_MB(4);
+	char *p = map_anon(size);
+	bool ok;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	ok = ok && !mprotect(p, size, PROT_READ);
+	ok = ok && !mprotect(p, size, PROT_READ | PROT_WRITE);
+	fill(p, size, 2);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "mprotect after checkpoint");
+	munmap(p, size);
+}
+
+static void test_fork(void)
+{
+	size_t size = SIZE_MB(4);
+	char *p = map_anon(size);
+	int status;
+	pid_t pid;
+	bool ok;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	pid = fork();
+	if (pid < 0)
+		ksft_exit_fail_msg("fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		/* The child sees the parent's memory and may scribble on it. */
+		if (!check(p, size, 1))
+			_exit(1);
+		fill(p, size, 3);
+		_exit(check(p, size, 3) ? 0 : 1);
+	}
+	fill(p, size, 2);
+	waitpid(pid, &status, 0);
+	ok = ok && WIFEXITED(status) && !WEXITSTATUS(status);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "restore after fork");
+	munmap(p, size);
+}
+
+/*
+ * Pages still shared with a child, and swapped out, come back from swap
+ * read-only: the first write goes from do_swap_page() to do_wp_page() and
+ * has to save them just like a write to a present page does.
+ */
+static void test_swap_fork(void)
+{
+	size_t size = SIZE_MB(4);
+	char *p = map_anon(size);
+	int fds[2], status;
+	pid_t pid;
+	bool ok;
+	char c;
+
+	if (pipe(fds))
+		ksft_exit_fail_msg("pipe failed: %s\n", strerror(errno));
+	fill(p, size, 1);
+	ok = checkpoint();
+	pid = fork();
+	if (pid < 0)
+		ksft_exit_fail_msg("fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		/* Hold on to the pages until the parent has written them. */
+		close(fds[1]);
+		if (read(fds[0], &c, 1) != 1)
+			_exit(1);
+		_exit(check(p, size, 1) ? 0 : 1);
+	}
+	close(fds[0]);
+	if (madvise(p, size, MADV_PAGEOUT)) {
+		ksft_test_result_skip("swapped out restore after fork: MADV_PAGEOUT: %s\n",
+				      strerror(errno));
+		close(fds[1]);
+		waitpid(pid, &status, 0);
+		restore();
+		munmap(p, size);
+		return;
+	}
+	fill(p, size, 2);
+	if (write(fds[1], "x", 1) != 1)
+		ok = false;
+	close(fds[1]);
+	waitpid(pid, &status, 0);
+	ok = ok && WIFEXITED(status) && !WEXITSTATUS(status);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "swapped out restore after fork");
+	munmap(p, size);
+}
+
+/*
+ * A child forked after a golden image was taken gets it back on restore:
+ * THP-backed memory it wrote, and memory that was unpopulated or mapped
+ * the zero page at the time, which reads as zeroes again.
+ */
+static void test_golden(void)
+{
+	size_t hpage = SIZE_MB(2), size = 2 * hpage, zsize = SIZE_MB(1), off;
+	char *map = map_anon(size + hpage), *z = map_anon(zsize);
+	char *p = (char *)(((uintptr_t)map + hpage - 1) & ~(hpage - 1));
+	const char *name = "golden image restore with THP";
+	volatile char c;
+	int status;
+	pid_t pid;
+	bool ok;
+
+	if (madvise(p, size, MADV_HUGEPAGE)) {
+		ksft_test_result_skip("%s: MADV_HUGEPAGE: %s\n", name,
+				      strerror(errno));
+		goto out;
+	}
+	fill(p, size, 1);
+	/* Every other page of @z maps the zero page, the rest nothing. */
+	for (off = 0; off < zsize; off += 2 * pagesize)
+		c = z[off];
+	(void)c;
+	if (mmcontext(MMCONTEXT_GOLDEN)) {
+		ksft_print_msg("golden image failed: %s\n", strerror(errno));
+		report(false, name);
+		goto out;
+	}
+	pid = fork();
+	if (pid < 0)
+		ksft_exit_fail_msg("fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		fill(p, size, 2);
+		fill(z, zsize, 3);
+		if (mmcontext(MMCONTEXT_RESTORE))
+			_exit(1);
+		_exit(check(p, size, 1) && zeroes(z, zsize) ? 0 : 1);
+	}
+	waitpid(pid, &status, 0);
+	ok = WIFEXITED(status) && !WEXITSTATUS(status);
+	ok = !mmcontext(MMCONTEXT_GOLDEN_DROP) && ok;
+	report(ok, name);
+out:
+	munmap(z, zsize);
+	munmap(map, size + hpage);
+}
+
+static volatile bool spinning;
+
+static void *spinner(void *data)
+{
+	while (spinning)
+		;
+	return NULL;
+}
+
+/*
+ * A process can exit with a checkpoint active and threads still running.
+ */
+static void test_exit(void)
+{
+	size_t size = SIZE_MB(4);
+	pthread_t threads[NR_THREADS];
+	int status, i;
+	char *p;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		ksft_exit_fail_msg("fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		p = map_anon(size);
+		fill(p, size, 1);
+		if (!checkpoint())
+			_exit(1);
+		fill(p, size, 2);
+		spinning = true;
+		for (i = 0; i < NR_THREADS; i++)
+			pthread_create(&threads[i], NULL, spinner, NULL);
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	report(WIFEXITED(status) && !WEXITSTATUS(status),
+	       "exit with a checkpoint active");
+}
+
+/*
+ * exec() drops the checkpoint: the new image can take a checkpoint of its
+ * own.
+ */
+static void test_exec(void)
+{
+	size_t size = SIZE_MB(4);
+	int status;
+	pid_t pid;
+	char *p;
+
+	pid = fork();
+	if (pid < 0)
+		ksft_exit_fail_msg("fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		p = map_anon(size);
+		fill(p, size, 1);
+		if (!checkpoint())
+			_exit(1);
+		fill(p, size, 2);
+		execl("/proc/self/exe", "mmcontext", "-e", NULL);
+		_exit(1);
+	}
+	waitpid(pid, &status, 0);
+	report(WIFEXITED(status) && !WEXITSTATUS(status),
+	       "checkpoint dropped on exec");
+}
+
+/* Run as -e, by the image test_exec() execs. */
+static int after_exec(void)
+{
+	return mmcontext(MMCONTEXT_CHECKPOINT) || mmcontext(MMCONTEXT_RESTORE);
+}
+
+/* The value of "@key:" in the proc file @path, or -1. */
+static long proc_value(const char *path, const char *key)
+{
+	size_t len = strlen(key);
+	char line[256];
+	long val = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, key, len) && line[len] == ':') {
+			val = strtol(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return val;
+}
+
+/*
+ * Pages pinned as io_uring fixed buffers are saved at checkpoint time,
+ * and still come back on restore.
+ */
+static void test_pinned(void)
+{
+	size_t size = SIZE_MB(1);
+	struct io_uring_params params = {};
+	char *p = map_anon(size);
+	struct iovec iov = { p, size };
+	bool ok;
+	int fd;
+
+	fill(p, size, 1);
+	fd = syscall(__NR_io_uring_setup, 1, &params);
+	if (fd < 0 || syscall(__NR_io_uring_register, fd,
+			      IORING_REGISTER_BUFFERS, &iov, 1)) {
+		ksft_test_result_skip("pinned restore: io_uring: %s\n",
+				      strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		munmap(p, size);
+		return;
+	}
+	ok = checkpoint();
+	ok = ok && proc_value("/proc/self/checkpoint", "Pinned") ==
+		   size / pagesize;
+	fill(p, size, 2);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1), "pinned restore");
+	close(fd);
+	munmap(p, size);
+}
+
+/* The pfn mapped at @p, as /proc/self/pagemap open at @fd has it, or 0. */
+static uint64_t pfn_of(int fd, const char *p)
+{
+	off_t pos = (uintptr_t)p / pagesize * sizeof(uint64_t);
+	uint64_t ent;
+
+	if (pread(fd, &ent, sizeof(ent), pos) != sizeof(ent))
+		return 0;
+	if (!(ent & (1ULL << 63)))
+		return 0;
+	return ent & ((1ULL << 55) - 1);
+}
+
+/*
+ * Compaction may move the pages staged in memory while the checkpoint is
+ * active, and the write-protected pages still to be saved; the former
+ * must still hold the old contents on restore, the latter still be saved
+ * on their first write. Staged pages cannot be seen from here, so the
+ * test checks that user pages of the checkpoint did move.
+ */
+static void test_compact(void)
+{
+	size_t size = SIZE_MB(16), half = size / 2, nr = size / pagesize, i;
+	const char *name = "restore after compaction";
+	char *p = map_anon(size);
+	unsigned long moved = 0;
+	uint64_t *pfns;
+	int fd, pm;
+	bool ok;
+
+	fd = open("/proc/sys/vm/compact_memory", O_WRONLY);
+	pm = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0 || pm < 0) {
+		ksft_test_result_skip("%s: %s\n", name, strerror(errno));
+		goto out;
+	}
+	pfns = calloc(nr, sizeof(*pfns));
+	if (!pfns)
+		ksft_exit_fail_msg("out of memory\n");
+	fill(p, size, 1);
+	ok = checkpoint();
+	/* Half is saved before compaction, half after. */
+	fill(p, half, 2);
+	for (i = 0; i < nr; i++)
+		pfns[i] = pfn_of(pm, p + i * pagesize);
+	ok = write(fd, "1", 1) == 1 && ok;
+	for (i = 0; i < nr; i++)
+		if (pfns[i] && pfn_of(pm, p + i * pagesize) != pfns[i])
+			moved++;
+	fill(p + half, half, 2);
+	ok = restore() && ok;
+	if (ok && !moved)
+		ksft_test_result_skip("%s: no page was moved\n", name);
+	else
+		report(ok && check(p, size, 1), name);
+	free(pfns);
+out:
+	if (pm >= 0)
+		close(pm);
+	if (fd >= 0)
+		close(fd);
+	munmap(p, size);
+}
+
+static bool read_str(const char *path, char *buf, size_t len)
+{
+	FILE *f = fopen(path, "r");
+	bool ok;
+
+	if (!f)
+		return false;
+	ok = fgets(buf, len, f) != NULL;
+	fclose(f);
+	return ok;
+}
+
+static bool write_str(const char *path, const char *val)
+{
+	int fd = open(path, O_WRONLY);
+	bool ok;
+
+	if (fd < 0)
+		return false;
+	ok = write(fd, val, strlen(val)) == (ssize_t)strlen(val);
+	close(fd);
+	return ok;
+}
+
+/*
+ * khugepaged collapses a range the checkpoint write-protected while none
+ * of its pages is saved yet; the first write after that splits the huge
+ * pmd again and saves the page written.
+ */
+static void test_khugepaged(void)
+{
+	const char *name = "restore after khugepaged collapse";
+	size_t hpage = SIZE_MB(2);
+	char *map = map_anon(2 * hpage);
+	char *p = (char *)(((uintptr_t)map + hpage - 1) & ~(hpage - 1));
+	char defer[16], sleep_ms[16], pages[16];
+	bool ok, collapsed = false;
+	long base;
+	int i;
+
+	if (!read_str(KHUGEPAGED "checkpoint_defer", defer, sizeof(defer)) ||
+	    !read_str(KHUGEPAGED "scan_sleep_millisecs", sleep_ms,
+		      sizeof(sleep_ms)) ||
+	    !read_str(KHUGEPAGED "pages_to_scan", pages, sizeof(pages))) {
+		ksft_test_result_skip("%s: %s\n", name, strerror(errno));
+		munmap(map, 2 * hpage);
+		return;
+	}
+	/* Small pages first, for khugepaged to find. */
+	madvise(p, hpage, MADV_NOHUGEPAGE);
+	fill(p, hpage, 1);
+	if (madvise(p, hpage, MADV_HUGEPAGE)) {
+		ksft_test_result_skip("%s: MADV_HUGEPAGE: %s\n", name,
+				      strerror(errno));
+		munmap(map, 2 * hpage);
+		return;
+	}
+	base = proc_value("/proc/self/smaps_rollup", "AnonHugePages");
+
+	ok = checkpoint();
+	write_str(KHUGEPAGED "checkpoint_defer", "0");
+	write_str(KHUGEPAGED "scan_sleep_millisecs", "10");
+	write_str(KHUGEPAGED "pages_to_scan", "4096");
+	for (i = 0; ok && !collapsed && i < 100; i++) {
+		usleep(100000);
+		collapsed = proc_value("/proc/self/smaps_rollup",
+				       "AnonHugePages") > base;
+	}
+	write_str(KHUGEPAGED "pages_to_scan", pages);
+	write_str(KHUGEPAGED "scan_sleep_millisecs", sleep_ms);
+	write_str(KHUGEPAGED "checkpoint_defer", defer);
+
+	memset(p + 3 * pagesize, 0x55, pagesize);
+	ok = restore() && ok;
+	if (ok && !collapsed)
+		ksft_test_result_skip("%s: not collapsed\n", name);
+	else
+		report(ok && check(p, hpage, 1), name);
+	munmap(map, 2 * hpage);
+}
+
+/*
+ * A checkpoint that memory.checkpoint.max has no room for fails with
+ * ENOMEM up front. The child joins a cgroup whose budget is well below
+ * what it has mapped.
+ */
+static void test_checkpoint_max(void)
+{
+	const char *name = "checkpoint over memory.checkpoint.max";
+	size_t size = SIZE_MB(4);
+	int status;
+	pid_t pid;
+	char *p;
+
+	if (mkdir(CGROUP_TEST, 0755) && errno != EEXIST) {
+		ksft_test_result_skip("%s: %s\n", name, strerror(errno));
+		return;
+	}
+	write_str("/sys/fs/cgroup/cgroup.subtree_control", "+memory");
+	if (!write_str(CGROUP_TEST "/memory.checkpoint.max", "1M")) {
+		ksft_test_result_skip("%s: %s\n", name, strerror(errno));
+		rmdir(CGROUP_TEST);
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0)
+		ksft_exit_fail_msg("fork failed: %s\n", strerror(errno));
+	if (!pid) {
+		if (!write_str(CGROUP_TEST "/cgroup.procs", "0"))
+			_exit(2);
+		p = map_anon(size);
+		fill(p, size, 1);
+		if (!mmcontext(MMCONTEXT_CHECKPOINT))
+			_exit(1);
+		_exit(errno == ENOMEM ? 0 : 1);
+	}
+	waitpid(pid, &status, 0);
+	rmdir(CGROUP_TEST);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 2)
+		ksft_test_result_skip("%s: cannot join the cgroup\n", name);
+	else
+		report(WIFEXITED(status) && !WEXITSTATUS(status), name);
+}
+
+static void test_mmap_after(void)
+{
+	size_t size = SIZE_MB(4);
+	char *p = map_anon(size), *q;
+	bool ok;
+
+	fill(p, size, 1);
+	ok = checkpoint();
+	q = map_anon(size);
+	fill(q, size, 4);
+	fill(p, size, 2);
+	ok = restore() && ok;
+	report(ok && check(p, size, 1) && check(q, size, 4),
+	       "mmap after checkpoint");
+	munmap(q, size);
+	munmap(p, size);
+}
+
+static void bench_checkpoint_time(void)
+{
+	static const size_t sizes[] = { 16, 64, 256, 1024 };
+	uint64_t t;
+	unsigned int i;
+	char *p;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		p = map_anon(SIZE_MB(sizes[i]));
+		fill(p, SIZE_MB(sizes[i]), 1);
+		t = now_ns();
+		if (checkpoint()) {
+			t = now_ns() - t;
+			ksft_print_msg("checkpoint: rss %4zu MB: %8llu us\n",
+				       sizes[i], (unsigned long long)t / 1000);
+			restore();
+		}
+		munmap(p, SIZE_MB(sizes[i]));
+	}
+}
+
+/*
+ * Checkpoint time with threads of the process running on other CPUs, so
+ * that every TLB flush has to reach them.
+ */
+static void bench_checkpoint_threads(void)
+{
+	size_t size = SIZE_MB(256);
+	pthread_t threads[NR_THREADS];
+	char *p = map_anon(size);
+	uint64_t t;
+	int i;
+
+	fill(p, size, 1);
+	spinning = true;
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_create(&threads[i], NULL, spinner, NULL);
+	t = now_ns();
+	if (checkpoint()) {
+		t = now_ns() - t;
+		ksft_print_msg("checkpoint: rss %4zu MB, %d threads: %8llu us\n",
+			       size >> 20, NR_THREADS,
+			       (unsigned long long)t / 1000);
+		restore();
+	}
+	spinning = false;
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	munmap(p, size);
+}
+
+static void bench_fault_restore(void)
+{
+	size_t size = SIZE_MB(256), off, nr = size / pagesize;
+	unsigned long hist[NR_HIST] = { 0 };
+	long avail_before, avail_after;
+	uint64_t t, total = 0;
+	char *p = map_anon(size);
+	int b;
+
+	fill(p, size, 1);
+	if (!checkpoint()) {
+		munmap(p, size);
+		return;
+	}
+
+	avail_before = proc_value("/proc/meminfo", "MemAvailable");
+	for (off = 0; off < size; off += pagesize) {
+		t = now_ns();
+		p[off] = 2;
+		t = now_ns() - t;
+		total += t;
+		for (b = 0; b < NR_HIST - 1 && (1ULL << (b + 1)) <= t; b++)
+			;
+		hist[b]++;
+	}
+	avail_after = proc_value("/proc/meminfo", "MemAvailable");
+
+	ksft_print_msg("COW fault latency: %zu pages, mean %llu ns\n", nr,
+		       (unsigned long long)(total / nr));
+	for (b = 0; b < NR_HIST; b++)
+		if (hist[b])
+			ksft_print_msg("  [%10llu, %10llu) ns: %lu\n",
+				       b ? 1ULL << b : 0ULL, 1ULL << (b + 1),
+				       hist[b]);
+	if (avail_before >= 0 && avail_after >= 0)
+		ksft_print_msg("memory overhead: %ld kB for %zu kB saved\n",
+			       avail_before - avail_after, size >> 10);
+
+	t = now_ns();
+	if (restore()) {
+		t = now_ns() - t;
+		ksft_print_msg("restore: %zu MB in %llu us, %llu MB/s\n",
+			       size >> 20, (unsigned long long)t / 1000,
+			       (unsigned long long)((size >> 20) * 1000000000ULL /
+						    (t ? t : 1)));
+	}
+	munmap(p, size);
+}
+
+int main(int argc, char **argv)
+{
+	bool bench = argc > 1 && !strcmp(argv[1], "-b");
+
+	if (argc > 1 && !strcmp(argv[1], "-e"))
+		return after_exec();
+
+	pagesize = getpagesize();
+	ksft_print_header();
+
+	if (mmcontext(-1) && errno == ENOSYS)
+		ksft_exit_skip("sys_mmcontext is not supported\n");
+	if (geteuid())
+		ksft_exit_skip("need root to create the checkpoint file\n");
+
+	ksft_set_plan(22);
+	test_single();
+	test_partial();
+	test_fixed_layout();
+	test_threads();
+	test_thp(MMCONTEXT_CHECKPOINT, "THP restore");
+	test_thp(MMCONTEXT_CHECKPOINT_SOFT_DIRTY, "soft-dirty THP restore");
+	test_swap();
+	test_mprotect();
+	test_dontneed();
+	test_mremap(0, "restore after mremap");
+	test_mremap(MMCONTEXT_FIXED_LAYOUT, "fixed layout restore after mremap");
+	test_soft_dirty();
+	test_fork();
+	test_swap_fork();
+	test_golden();
+	test_exit();
+	test_exec();
+	test_mmap_after();
+	test_pinned();
+	test_compact();
+	test_khugepaged();
+	test_checkpoint_max();
+
+	if (bench) {
+		bench_checkpoint_time();
+		bench_checkpoint_threads();
+		bench_fault_restore();
+	}
+
+	return ksft_get_fail_cnt() ? ksft_exit_fail() : ksft_exit_pass();
+}